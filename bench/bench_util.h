@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Minimal timing helpers shared by the benchmarks
+
+// Forces `value` to be materialized, so the computation producing it is not optimized away
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Makes the compiler assume `ptr` and all memory may have been read and written
+template <typename T>
+inline void Escape(T* ptr) {
+    asm volatile("" : : "g"(ptr) : "memory");
+}
+
+inline void ClobberMemory() {
+    asm volatile("" : : : "memory");
+}
+
+inline double NowNs() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double, std::nano>(now).count();
+}
+
+// Calls `body(iterations)` with growing iteration counts until one run takes at least
+// `min_time_ns`, then returns the best ns/op over `repetitions` runs of that size
+template <typename Body>
+double MeasureNsPerOp(Body&& body, double min_time_ns = 2e7, int repetitions = 5) {
+    int64_t iterations = 1;
+    while (true) {
+        double begin = NowNs();
+        body(iterations);
+        double elapsed = NowNs() - begin;
+        if (elapsed >= min_time_ns || iterations >= (int64_t{1} << 34)) {
+            break;
+        }
+        double scale = elapsed > 0 ? 1.4 * min_time_ns / elapsed : 10.0;
+        iterations = static_cast<int64_t>(iterations * std::clamp(scale, 2.0, 10.0));
+    }
+
+    std::vector<double> samples;
+    for (int i = 0; i < repetitions; ++i) {
+        double begin = NowNs();
+        body(iterations);
+        samples.push_back((NowNs() - begin) / iterations);
+    }
+    return *std::min_element(samples.begin(), samples.end());
+}
+
+// Escapes `text` for a JSON string literal
+inline std::string JsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
@@ -0,0 +1,168 @@
+// Large-buffer helpers of `unique_buffer.h` against their `std::` equivalents: each case
+// allocates a buffer, writes every element once and frees it. Then a file of the same size is
+// read once with `read()` into a buffer and once through each way of owning a `MappedFile`.
+//
+// Usage: buffer_bench [--mib N]
+
+#include "bench_util.h"
+#include "mapped_file.h"
+#include "unique_buffer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+template <typename Buffer>
+void Fill(Buffer& buffer, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        buffer[i] = static_cast<int64_t>(i);
+    }
+    DoNotOptimize(buffer[count - 1]);
+}
+
+template <typename Make>
+void Run(const char* name, size_t count, Make make) {
+    double ns = MeasureNsPerOp(
+        [&](int64_t n) {
+            for (int64_t i = 0; i < n; ++i) {
+                auto buffer = make();
+                Fill(buffer, count);
+            }
+        },
+        1e8, 3);
+    double bytes = static_cast<double>(count * sizeof(int64_t));
+    std::printf("%-28s %12.3f %10.2f\n", name, ns / 1e6, bytes / ns);
+}
+
+void RunBuffers(size_t count) {
+    Run("std value-init new[]", count,
+        [count] { return std::unique_ptr<int64_t[]>(new int64_t[count]()); });
+    Run("MakeUniqueAligned(64)", count,
+        [count] { return MakeUniqueAligned<int64_t[]>(count, 64); });
+    Run("std default-init new[]", count,
+        [count] { return std::unique_ptr<int64_t[]>(new int64_t[count]); });
+    Run("MakeUniqueForOverwrite", count,
+        [count] { return MakeUniqueForOverwrite<int64_t[]>(count); });
+    Run("MakeUniqueMapped", count, [count] { return MakeUniqueMapped<int64_t[]>(count); });
+    Run("MakeUniqueMapped(populate)", count,
+        [count] { return MakeUniqueMapped<int64_t[]>(count, MapFlags::kPopulate); });
+    Run("MakeUniqueMapped(huge)", count,
+        [count] { return MakeUniqueMapped<int64_t[]>(count, MapFlags::kHugePages); });
+}
+
+// Writes `count` integers to a temporary file and returns its path
+std::string WriteFile(size_t count) {
+    char path[] = "/tmp/buffer_bench.XXXXXX";
+    int fd = ::mkstemp(path);
+    if (fd < 0) {
+        throw std::runtime_error("mkstemp failed");
+    }
+    auto data = MakeUniqueForOverwrite<int64_t[]>(count);
+    Fill(data, count);
+    const char* bytes = reinterpret_cast<const char*>(data.Get());
+    size_t left = count * sizeof(int64_t);
+    while (left > 0) {
+        ssize_t written = ::write(fd, bytes, left);
+        if (written <= 0) {
+            ::close(fd);
+            throw std::runtime_error("write failed");
+        }
+        bytes += written;
+        left -= static_cast<size_t>(written);
+    }
+    ::close(fd);
+    return path;
+}
+
+int64_t Sum(const int64_t* data, size_t count) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+template <typename Read>
+void RunRead(const char* name, size_t count, Read read) {
+    double ns = MeasureNsPerOp(
+        [&](int64_t n) {
+            for (int64_t i = 0; i < n; ++i) {
+                DoNotOptimize(read());
+            }
+        },
+        1e8, 3);
+    double bytes = static_cast<double>(count * sizeof(int64_t));
+    std::printf("%-28s %12.3f %10.2f\n", name, ns / 1e6, bytes / ns);
+}
+
+void RunFile(size_t count) {
+    std::string path = WriteFile(count);
+    RunRead("read() into buffer", count, [&] {
+        auto buffer = MakeUniqueForOverwrite<int64_t[]>(count);
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        char* bytes = reinterpret_cast<char*>(buffer.Get());
+        size_t left = count * sizeof(int64_t);
+        while (left > 0) {
+            ssize_t got = ::read(fd, bytes, left);
+            if (got <= 0) {
+                break;
+            }
+            bytes += got;
+            left -= static_cast<size_t>(got);
+        }
+        ::close(fd);
+        return Sum(buffer.Get(), count);
+    });
+    RunRead("MappedFile", count, [&] {
+        MappedFile file = MappedFile::Open(path, {AccessPattern::kSequential, false});
+        return Sum(reinterpret_cast<const int64_t*>(file.Data()), file.Count<int64_t>());
+    });
+    RunRead("MappedFile::ReleaseUnique", count, [&] {
+        auto data = MappedFile::Open(path).ReleaseUnique<int64_t>();
+        return Sum(data.Get(), count);
+    });
+    // Second half through a slice that outlives the first pointer
+    RunRead("MappedFile::Share + slice", count, [&] {
+        SharedPtr<const int64_t> whole =
+            MappedFile::Open(path, {AccessPattern::kSequential, true}).Share<int64_t>();
+        size_t half = count / 2;
+        auto tail = MappedSlice<int64_t>(whole, half * sizeof(int64_t));
+        int64_t sum = Sum(whole.Get(), half);
+        whole.Reset();
+        return sum + Sum(tail.Get(), count - half);
+    });
+    ::unlink(path.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t mib = 64;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--mib") == 0 && i + 1 < argc) {
+            mib = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [--mib N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (mib == 0) {
+        std::fprintf(stderr, "--mib must be positive\n");
+        return 2;
+    }
+
+    size_t count = (mib << 20) / sizeof(int64_t);
+    std::printf("%zu MiB buffers\n", mib);
+    std::printf("%-28s %12s %10s\n", "buffer", "ms/buffer", "GB/s");
+    RunBuffers(count);
+    RunFile(count);
+}
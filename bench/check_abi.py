@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Checks that passing `UniquePtr<int>` by value compiles to the same code as a raw pointer.
+
+usage: check_abi.py [--cxx COMPILER] [--include DIR]
+
+Builds a forwarding function for each with SMART_PTRS_TRIVIAL_ABI at -O2 and compares their
+instruction counts. Exits with status 1 if the `UniquePtr` one is longer, and with status 0 and
+a note when the compiler has no `[[clang::trivial_abi]]`.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+PROBE = """
+#if __has_cpp_attribute(clang::trivial_abi)
+TRIVIAL_ABI_SUPPORTED
+#endif
+"""
+
+SOURCE = """
+#include "unique.h"
+
+void TakeRaw(int* ptr);
+void TakeUnique(UniquePtr<int> ptr);
+
+void ForwardRaw(int* ptr) {
+    TakeRaw(ptr);
+}
+
+void ForwardUnique(UniquePtr<int> ptr) {
+    TakeUnique(std::move(ptr));
+}
+"""
+
+DIRECTIVE = re.compile(r"^\s*(\.|#|$)")
+LABEL = re.compile(r"^[\w.$]+:")
+
+
+def compile_to_asm(cxx, include):
+    command = [cxx, "-std=c++17", "-O2", "-DSMART_PTRS_TRIVIAL_ABI", "-I", include,
+               "-fno-asynchronous-unwind-tables", "-S", "-o", "-", "-x", "c++", "-"]
+    return subprocess.run(command, input=SOURCE, capture_output=True, text=True,
+                          check=True).stdout
+
+
+def instruction_counts(asm):
+    counts = {}
+    current = None
+    for line in asm.splitlines():
+        label = LABEL.match(line)
+        if label and not line.startswith("."):
+            current = label.group(0)[:-1]
+            counts[current] = 0
+        elif current is not None and not DIRECTIVE.match(line) and not LABEL.match(line):
+            counts[current] += 1
+    return counts
+
+
+def find(counts, name):
+    for symbol, count in counts.items():
+        if name in symbol:
+            return count
+    sys.exit(f"symbol {name} not found in the assembly")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--cxx", default=os.environ.get("CXX", "c++"))
+    parser.add_argument("--include",
+                        default=os.path.join(os.path.dirname(__file__), "..", "include"))
+    args = parser.parse_args()
+
+    probe = subprocess.run([args.cxx, "-std=c++17", "-E", "-x", "c++", "-"], input=PROBE,
+                           capture_output=True, text=True, check=True).stdout
+    if "TRIVIAL_ABI_SUPPORTED" not in probe:
+        print(f"{args.cxx} has no [[clang::trivial_abi]]; UniquePtr is passed in memory")
+        return 0
+
+    counts = instruction_counts(compile_to_asm(args.cxx, args.include))
+    raw = find(counts, "ForwardRaw")
+    unique = find(counts, "ForwardUnique")
+    print(f"ForwardRaw: {raw} instructions, ForwardUnique: {unique} instructions")
+    if unique > raw:
+        print("UniquePtr is not passed like a raw pointer")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
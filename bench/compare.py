@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Compares two `smart_ptrs_bench --json` runs and flags regressions.
+
+usage: compare.py BASELINE.json CURRENT.json [--threshold 0.10]
+
+Exits with status 1 if any benchmark got slower by more than the threshold or started
+allocating more, so it can gate CI.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as source:
+        data = json.load(source)
+    return {entry["name"]: entry for entry in data["benchmarks"]}, {
+        entry["name"]: entry["bytes"] for entry in data.get("sizes", [])
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="relative slowdown reported as a regression (default 0.10)")
+    args = parser.parse_args()
+
+    baseline, baseline_sizes = load(args.baseline)
+    current, current_sizes = load(args.current)
+
+    regressions = []
+    print(f"{'benchmark':36} {'base ns':>10} {'new ns':>10} {'change':>8}")
+    for name in sorted(baseline.keys() & current.keys()):
+        old, new = baseline[name], current[name]
+        change = new["ns_per_op"] / old["ns_per_op"] - 1 if old["ns_per_op"] > 0 else 0.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  REGRESSION"
+            regressions.append(name)
+        if new["allocs_per_op"] > old["allocs_per_op"]:
+            mark += "  MORE ALLOCATIONS"
+            regressions.append(name)
+        print(f"{name:36} {old['ns_per_op']:10.2f} {new['ns_per_op']:10.2f} {change:+8.1%}{mark}")
+
+    for name in sorted(baseline.keys() - current.keys()):
+        print(f"{name:36} missing from current run")
+
+    for name in sorted(baseline_sizes.keys() & current_sizes.keys()):
+        if current_sizes[name] != baseline_sizes[name]:
+            print(f"sizeof({name}): {baseline_sizes[name]} -> {current_sizes[name]}")
+            if current_sizes[name] > baseline_sizes[name]:
+                regressions.append(name)
+
+    if regressions:
+        print(f"\n{len(set(regressions))} regression(s)")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,112 @@
+// `CowPtr<T>` against copying `T` by value in a read-heavy workload: every operation copies the
+// value (as when storing it in a container or passing it to another component), reads it and,
+// with the given probability, mutates the copy.
+//
+// Usage: cow_bench [--elements N]
+
+#include "bench_util.h"
+#include "cow.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Typical large value: a few strings and a table of numbers
+struct Config {
+    std::string name;
+    std::string owner;
+    std::vector<int64_t> table;
+};
+
+Config MakeConfig(size_t elements) {
+    Config config;
+    config.name = "service.production.frontend";
+    config.owner = "team-infrastructure@example.com";
+    config.table.assign(elements, 1);
+    return config;
+}
+
+// Reads two fields, as a consumer of the value would
+int64_t Consume(const Config& config, int64_t i) {
+    return static_cast<int64_t>(config.name.size()) + config.table[i % config.table.size()];
+}
+
+double RunCow(const Config& initial, int64_t writes_per_1024) {
+    CowPtr<Config> value(initial);
+    return MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            CowPtr<Config> copy = value;
+            DoNotOptimize(Consume(*copy, i));
+            if ((i & 1023) < writes_per_1024) {
+                copy.Mutate().table[0] = i;
+                DoNotOptimize(copy->table[0]);
+            }
+        }
+    });
+}
+
+double RunValue(const Config& initial, int64_t writes_per_1024) {
+    Config value = initial;
+    return MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            Config copy = value;
+            DoNotOptimize(Consume(copy, i));
+            if ((i & 1023) < writes_per_1024) {
+                copy.table[0] = i;
+                DoNotOptimize(copy.table[0]);
+            }
+        }
+    });
+}
+
+// Cost of the read path alone: no counter traffic compared with a plain reference
+void RunReads(const Config& initial) {
+    CowPtr<Config> cow(initial);
+    const Config& plain = initial;
+    double cow_ns = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            DoNotOptimize(Consume(cow.Read(), i));
+        }
+    });
+    double plain_ns = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            DoNotOptimize(Consume(plain, i));
+        }
+    });
+    std::printf("%-12s %14.2f %14.2f %9.2fx\n", "read only", cow_ns, plain_ns, plain_ns / cow_ns);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t elements = 4096;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--elements") == 0 && i + 1 < argc) {
+            elements = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [--elements N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (elements == 0) {
+        std::fprintf(stderr, "--elements must be positive\n");
+        return 2;
+    }
+
+    Config initial = MakeConfig(elements);
+    std::printf("value of %zu bytes\n", sizeof(Config) + elements * sizeof(int64_t));
+    std::printf("%-12s %14s %14s %10s\n", "writes", "cow ns/op", "value ns/op", "speedup");
+    for (int64_t writes_per_1024 : {0, 10, 102, 1024}) {
+        double cow = RunCow(initial, writes_per_1024);
+        double value = RunValue(initial, writes_per_1024);
+        char label[16];
+        std::snprintf(label, sizeof(label), "%.1f%%", writes_per_1024 * 100.0 / 1024);
+        std::printf("%-12s %14.2f %14.2f %9.2fx\n", label, cow, value, value / cow);
+    }
+    RunReads(initial);
+}
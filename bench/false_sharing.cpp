@@ -0,0 +1,74 @@
+// Shows the false-sharing penalty of `MakeShared` layouts: one thread copies and drops a
+// `SharedPtr` (touching only the counters), another thread writes the pointee. With the packed
+// layout both live on one cache line and the line ping-pongs between cores.
+
+#ifndef SMART_PTRS_ATOMIC_COUNTERS
+#error "false_sharing_bench needs SMART_PTRS_ATOMIC_COUNTERS"
+#endif
+
+#include "bench_util.h"
+#include "shared.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+namespace {
+
+constexpr int64_t kIterations = 20'000'000;
+
+struct Payload {
+    std::atomic<int64_t> hot{0};
+};
+
+template <typename Layout>
+double Run() {
+    SharedPtr<Payload> ptr = MakeSharedWithLayout<Payload, Layout>();
+    std::atomic<int> ready{0};
+
+    auto start_together = [&ready] {
+        ready.fetch_add(1);
+        while (ready.load() < 2) {
+        }
+    };
+
+    // The counters are only touched by this thread, the payload only by the writer
+    std::thread refcounter([&] {
+        start_together();
+        for (int64_t i = 0; i < kIterations; ++i) {
+            SharedPtr<Payload> copy(ptr);
+            Escape(&copy);
+        }
+    });
+    Payload* payload = ptr.Get();
+    std::thread writer([&] {
+        start_together();
+        for (int64_t i = 0; i < kIterations; ++i) {
+            payload->hot.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    auto begin = std::chrono::steady_clock::now();
+    refcounter.join();
+    writer.join();
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / kIterations;
+}
+
+}  // namespace
+
+int main() {
+    if (std::thread::hardware_concurrency() < 2) {
+        std::printf("warning: fewer than 2 cores, threads share a cache and no penalty shows\n");
+    }
+    double packed = Run<PackedLayout>();
+    double padded = Run<PaddedLayout>();
+    std::printf("%-8s %8s %10s\n", "layout", "ns/op", "block");
+    std::printf("%-8s %8.2f %10zu\n", "packed", packed, sizeof(ControlBlockWithObj<Payload>));
+    std::printf("%-8s %8.2f %10zu\n", "padded", padded,
+                sizeof(ControlBlockWithObj<Payload, PaddedLayout>));
+    std::printf("speedup  %8.2fx\n", packed / padded);
+    return 0;
+}
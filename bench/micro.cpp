@@ -0,0 +1,489 @@
+// Single-threaded micro-benchmarks of every pointer operation against its `std::` equivalent.
+//
+// Usage: smart_ptrs_bench [--json FILE] [--filter SUBSTRING] [--min-time-ms MS]
+// Compare two JSON runs with bench/compare.py.
+
+#include "bench_util.h"
+#include "intrusive.h"
+#include "shared.h"
+#include "unique.h"
+#include "weak.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation counting
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+}  // namespace
+
+// Kept out of line: inlined into a caller, GCC reports -Wuse-after-free on the counters of
+// blocks freed through these functions
+[[gnu::noinline]] void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc{};
+}
+
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Registry
+
+struct Benchmark {
+    std::string name;
+    std::function<void(int64_t)> body;
+};
+
+struct Result {
+    std::string name;
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+std::vector<Benchmark>& Registry() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+void Register(std::string name, std::function<void(int64_t)> body) {
+    Registry().push_back({std::move(name), std::move(body)});
+}
+
+struct Node : SimpleRefCounted<Node> {
+    int64_t value = 0;
+};
+
+struct StatelessDeleter {
+    void operator()(int* p) const {
+        delete p;
+    }
+};
+
+// Out-of-line callees, so the pass-by-value benchmarks measure a real call boundary. With
+// SMART_PTRS_TRIVIAL_ABI on clang, `SinkOurs` compiles to the same code as `SinkRaw`.
+[[gnu::noinline]] int* SinkRaw(int* ptr) {
+    Escape(&ptr);
+    return ptr;
+}
+
+[[gnu::noinline]] UniquePtr<int> SinkOurs(UniquePtr<int> ptr) {
+    Escape(&ptr);
+    return ptr;
+}
+
+[[gnu::noinline]] std::unique_ptr<int> SinkStd(std::unique_ptr<int> ptr) {
+    Escape(&ptr);
+    return ptr;
+}
+
+static_assert(sizeof(UniquePtr<int>) == sizeof(int*));
+static_assert(sizeof(UniquePtr<int, StatelessDeleter>) == sizeof(int*));
+static_assert(std::is_trivially_copyable_v<CompressedPair<int*, DefaultDeleter<int>>>);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmarks. Every pair is named `<group>/<operation>/{ours,std}`.
+
+void RegisterShared() {
+    Register("shared/construct_destroy/ours", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            SharedPtr<int> ptr(new int(1));
+            Escape(&ptr);
+        }
+    });
+    Register("shared/construct_destroy/std", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::shared_ptr<int> ptr(new int(1));
+            Escape(&ptr);
+        }
+    });
+
+    Register("shared/make/ours", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            auto ptr = MakeShared<int>(1);
+            Escape(&ptr);
+        }
+    });
+    Register("shared/make/std", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            auto ptr = std::make_shared<int>(1);
+            Escape(&ptr);
+        }
+    });
+
+    Register("shared/copy/ours", [](int64_t n) {
+        auto origin = MakeShared<int>(1);
+        for (int64_t i = 0; i < n; ++i) {
+            SharedPtr<int> copy(origin);
+            Escape(&copy);
+        }
+    });
+    Register("shared/copy/std", [](int64_t n) {
+        auto origin = std::make_shared<int>(1);
+        for (int64_t i = 0; i < n; ++i) {
+            std::shared_ptr<int> copy(origin);
+            Escape(&copy);
+        }
+    });
+
+    Register("shared/move/ours", [](int64_t n) {
+        auto first = MakeShared<int>(1);
+        SharedPtr<int> second;
+        for (int64_t i = 0; i < n; ++i) {
+            second = std::move(first);
+            first = std::move(second);
+            Escape(&first);
+        }
+    });
+    Register("shared/move/std", [](int64_t n) {
+        auto first = std::make_shared<int>(1);
+        std::shared_ptr<int> second;
+        for (int64_t i = 0; i < n; ++i) {
+            second = std::move(first);
+            first = std::move(second);
+            Escape(&first);
+        }
+    });
+
+    Register("shared/reset/ours", [](int64_t n) {
+        SharedPtr<int> ptr;
+        for (int64_t i = 0; i < n; ++i) {
+            ptr.Reset(new int(1));
+            Escape(&ptr);
+        }
+    });
+    Register("shared/reset/std", [](int64_t n) {
+        std::shared_ptr<int> ptr;
+        for (int64_t i = 0; i < n; ++i) {
+            ptr.reset(new int(1));
+            Escape(&ptr);
+        }
+    });
+}
+
+void RegisterWeak() {
+    Register("weak/lock/ours", [](int64_t n) {
+        auto origin = MakeShared<int>(1);
+        WeakPtr<int> weak(origin);
+        for (int64_t i = 0; i < n; ++i) {
+            auto locked = weak.Lock();
+            Escape(&locked);
+        }
+    });
+    Register("weak/lock/std", [](int64_t n) {
+        auto origin = std::make_shared<int>(1);
+        std::weak_ptr<int> weak(origin);
+        for (int64_t i = 0; i < n; ++i) {
+            auto locked = weak.lock();
+            Escape(&locked);
+        }
+    });
+
+    Register("weak/copy/ours", [](int64_t n) {
+        auto origin = MakeShared<int>(1);
+        WeakPtr<int> weak(origin);
+        for (int64_t i = 0; i < n; ++i) {
+            WeakPtr<int> copy(weak);
+            Escape(&copy);
+        }
+    });
+    Register("weak/copy/std", [](int64_t n) {
+        auto origin = std::make_shared<int>(1);
+        std::weak_ptr<int> weak(origin);
+        for (int64_t i = 0; i < n; ++i) {
+            std::weak_ptr<int> copy(weak);
+            Escape(&copy);
+        }
+    });
+}
+
+void RegisterUnique() {
+    Register("unique/construct_destroy/ours", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            UniquePtr<int> ptr(new int(1));
+            Escape(&ptr);
+        }
+    });
+    Register("unique/construct_destroy/std", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::unique_ptr<int> ptr(new int(1));
+            Escape(&ptr);
+        }
+    });
+
+    Register("unique/move/ours", [](int64_t n) {
+        UniquePtr<int> first(new int(1));
+        UniquePtr<int> second;
+        for (int64_t i = 0; i < n; ++i) {
+            second = std::move(first);
+            first = std::move(second);
+            Escape(&first);
+        }
+    });
+    Register("unique/move/std", [](int64_t n) {
+        auto first = std::make_unique<int>(1);
+        std::unique_ptr<int> second;
+        for (int64_t i = 0; i < n; ++i) {
+            second = std::move(first);
+            first = std::move(second);
+            Escape(&first);
+        }
+    });
+
+    Register("unique/swap/ours", [](int64_t n) {
+        UniquePtr<int> first(new int(1));
+        UniquePtr<int> second(new int(2));
+        for (int64_t i = 0; i < n; ++i) {
+            first.Swap(second);
+            Escape(&first);
+        }
+    });
+    Register("unique/swap/std", [](int64_t n) {
+        auto first = std::make_unique<int>(1);
+        auto second = std::make_unique<int>(2);
+        for (int64_t i = 0; i < n; ++i) {
+            first.swap(second);
+            Escape(&first);
+        }
+    });
+
+    Register("unique/reset/ours", [](int64_t n) {
+        UniquePtr<int> ptr;
+        for (int64_t i = 0; i < n; ++i) {
+            ptr.Reset(new int(1));
+            Escape(&ptr);
+        }
+    });
+    Register("unique/reset/std", [](int64_t n) {
+        std::unique_ptr<int> ptr;
+        for (int64_t i = 0; i < n; ++i) {
+            ptr.reset(new int(1));
+            Escape(&ptr);
+        }
+    });
+
+    // Typed pointer converted to its type-erased form and destroyed through it
+    Register("unique/type_erased/ours", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            AnyUniquePtr ptr = UniquePtr<int>(new int(1));
+            Escape(&ptr);
+        }
+    });
+    Register("unique/type_erased/std", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::unique_ptr<void, void (*)(void*)> ptr(
+                new int(1), [](void* p) { delete static_cast<int*>(p); });
+            Escape(&ptr);
+        }
+    });
+
+    // Round trip through a non-inlined function taking and returning the pointer by value
+    Register("unique/pass_by_value/ours", [](int64_t n) {
+        UniquePtr<int> ptr(new int(1));
+        for (int64_t i = 0; i < n; ++i) {
+            ptr = SinkOurs(std::move(ptr));
+        }
+        Escape(&ptr);
+    });
+    Register("unique/pass_by_value/std", [](int64_t n) {
+        auto ptr = std::make_unique<int>(1);
+        for (int64_t i = 0; i < n; ++i) {
+            ptr = SinkStd(std::move(ptr));
+        }
+        Escape(&ptr);
+    });
+    Register("unique/pass_by_value/raw", [](int64_t n) {
+        int* ptr = new int(1);
+        for (int64_t i = 0; i < n; ++i) {
+            ptr = SinkRaw(ptr);
+        }
+        delete ptr;
+    });
+}
+
+// The standard library has no intrusive pointer, so `std::shared_ptr` made with
+// `std::make_shared` is the closest single-allocation equivalent
+void RegisterIntrusive() {
+    Register("intrusive/make/ours", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            auto ptr = MakeIntrusive<Node>();
+            Escape(&ptr);
+        }
+    });
+    Register("intrusive/make/std", [](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            auto ptr = std::make_shared<Node>();
+            Escape(&ptr);
+        }
+    });
+
+    Register("intrusive/copy/ours", [](int64_t n) {
+        auto origin = MakeIntrusive<Node>();
+        for (int64_t i = 0; i < n; ++i) {
+            IntrusivePtr<Node> copy(origin);
+            Escape(&copy);
+        }
+    });
+    Register("intrusive/copy/std", [](int64_t n) {
+        auto origin = std::make_shared<Node>();
+        for (int64_t i = 0; i < n; ++i) {
+            std::shared_ptr<Node> copy(origin);
+            Escape(&copy);
+        }
+    });
+
+    Register("intrusive/move/ours", [](int64_t n) {
+        auto first = MakeIntrusive<Node>();
+        IntrusivePtr<Node> second;
+        for (int64_t i = 0; i < n; ++i) {
+            second = std::move(first);
+            first = std::move(second);
+            Escape(&first);
+        }
+    });
+    Register("intrusive/move/std", [](int64_t n) {
+        auto first = std::make_shared<Node>();
+        std::shared_ptr<Node> second;
+        for (int64_t i = 0; i < n; ++i) {
+            second = std::move(first);
+            first = std::move(second);
+            Escape(&first);
+        }
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Size report
+
+struct Size {
+    const char* name;
+    size_t bytes;
+};
+
+std::vector<Size> Sizes() {
+    return {
+        {"SharedPtr<int>", sizeof(SharedPtr<int>)},
+        {"std::shared_ptr<int>", sizeof(std::shared_ptr<int>)},
+        {"WeakPtr<int>", sizeof(WeakPtr<int>)},
+        {"std::weak_ptr<int>", sizeof(std::weak_ptr<int>)},
+        {"UniquePtr<int>", sizeof(UniquePtr<int>)},
+        {"UniquePtr<int, StatelessDeleter>", sizeof(UniquePtr<int, StatelessDeleter>)},
+        {"std::unique_ptr<int>", sizeof(std::unique_ptr<int>)},
+        {"AnyUniquePtr", sizeof(AnyUniquePtr)},
+        {"std::unique_ptr<void, fn ptr>", sizeof(std::unique_ptr<void, void (*)(void*)>)},
+        {"IntrusivePtr<Node>", sizeof(IntrusivePtr<Node>)},
+        {"ControlBlockWithPointer<int>", sizeof(ControlBlockWithPointer<int>)},
+        {"ControlBlockWithObj<int>", sizeof(ControlBlockWithObj<int>)},
+    };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Driver
+
+Result Run(const Benchmark& benchmark, double min_time_ns) {
+    constexpr int64_t kAllocationProbe = 1000;
+    uint64_t before = allocations.load(std::memory_order_relaxed);
+    benchmark.body(kAllocationProbe);
+    uint64_t allocated = allocations.load(std::memory_order_relaxed) - before;
+
+    double ns = MeasureNsPerOp(benchmark.body, min_time_ns);
+    return {benchmark.name, ns, static_cast<double>(allocated) / kAllocationProbe};
+}
+
+void WriteJson(const char* path, const std::vector<Result>& results) {
+    FILE* out = std::fopen(path, "w");
+    if (out == nullptr) {
+        std::perror(path);
+        std::exit(1);
+    }
+    std::fprintf(out, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        std::fprintf(out, "    {\"name\": \"%s\", \"ns_per_op\": %.4f, \"allocs_per_op\": %.4f}%s\n",
+                     JsonEscape(results[i].name).c_str(), results[i].ns_per_op,
+                     results[i].allocs_per_op, i + 1 == results.size() ? "" : ",");
+    }
+    std::fprintf(out, "  ],\n  \"sizes\": [\n");
+    auto sizes = Sizes();
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        std::fprintf(out, "    {\"name\": \"%s\", \"bytes\": %zu}%s\n",
+                     JsonEscape(sizes[i].name).c_str(), sizes[i].bytes,
+                     i + 1 == sizes.size() ? "" : ",");
+    }
+    std::fprintf(out, "  ]\n}\n");
+    std::fclose(out);
+}
+
+void Usage(const char* program) {
+    std::fprintf(stderr, "usage: %s [--json FILE] [--filter SUBSTRING] [--min-time-ms MS]\n",
+                 program);
+    std::exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const char* json_path = nullptr;
+    std::string filter;
+    double min_time_ns = 2e7;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--min-time-ms") == 0 && i + 1 < argc) {
+            min_time_ns = std::atof(argv[++i]) * 1e6;
+        } else {
+            Usage(argv[0]);
+        }
+    }
+
+    RegisterShared();
+    RegisterWeak();
+    RegisterUnique();
+    RegisterIntrusive();
+
+    std::vector<Result> results;
+    std::printf("%-36s %10s %10s\n", "benchmark", "ns/op", "allocs/op");
+    for (const auto& benchmark : Registry()) {
+        if (benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        results.push_back(Run(benchmark, min_time_ns));
+        const Result& result = results.back();
+        std::printf("%-36s %10.2f %10.2f\n", result.name.c_str(), result.ns_per_op,
+                    result.allocs_per_op);
+    }
+
+    std::printf("\n%-36s %10s\n", "type", "bytes");
+    for (const auto& size : Sizes()) {
+        std::printf("%-36s %10zu\n", size.name, size.bytes);
+    }
+
+    if (json_path != nullptr) {
+        WriteJson(json_path, results);
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+// Persistent containers against copying their `std::` equivalents. A snapshot of the std
+// container is a deep copy, a snapshot of the persistent one is a pointer copy, and an update
+// copies O(log32 n) nodes.
+//
+// Usage: persistent_bench [--size N]
+
+#include "bench_util.h"
+#include "persistent_map.h"
+#include "persistent_vector.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Indices are drawn up front so the generator stays out of the measurement
+std::vector<size_t> RandomIndices(size_t size) {
+    std::mt19937_64 rng(42);
+    std::vector<size_t> indices(1 << 16);
+    for (size_t& index : indices) {
+        index = rng() % size;
+    }
+    return indices;
+}
+
+void Report(const char* name, double ours, double std_ns) {
+    std::printf("%-22s %14.1f %14.1f %9.1fx\n", name, ours, std_ns, std_ns / ours);
+}
+
+void BenchVector(size_t size) {
+    std::vector<size_t> indices = RandomIndices(size);
+    size_t mask = indices.size() - 1;
+
+    std::vector<int64_t> std_vector(size);
+    TransientVector<int64_t> builder;
+    for (size_t i = 0; i < size; ++i) {
+        builder.PushBack(0);
+    }
+    PersistentVector<int64_t> vector = std::move(builder).Persistent();
+
+    // Readers keep the previous version while the writer publishes the next one
+    double ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            PersistentVector<int64_t> snapshot = vector;
+            vector = snapshot.Set(indices[i & mask], i);
+            DoNotOptimize(snapshot);
+        }
+    });
+    double theirs = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::vector<int64_t> snapshot = std_vector;
+            std_vector[indices[i & mask]] = i;
+            DoNotOptimize(snapshot.data());
+        }
+    });
+    Report("vector/snapshot_set", ours, theirs);
+
+    ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            DoNotOptimize(vector[indices[i & mask]]);
+        }
+    });
+    theirs = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            DoNotOptimize(std_vector[indices[i & mask]]);
+        }
+    });
+    Report("vector/random_read", ours, theirs);
+
+    // Per element of a full build
+    ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            TransientVector<int64_t> built;
+            for (size_t j = 0; j < size; ++j) {
+                built.PushBack(static_cast<int64_t>(j));
+            }
+            DoNotOptimize(std::move(built).Persistent());
+        }
+    }) / size;
+    theirs = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::vector<int64_t> built;
+            for (size_t j = 0; j < size; ++j) {
+                built.push_back(static_cast<int64_t>(j));
+            }
+            DoNotOptimize(built.data());
+        }
+    }) / size;
+    Report("vector/transient_build", ours, theirs);
+
+    ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            PersistentVector<int64_t> built;
+            for (size_t j = 0; j < size; ++j) {
+                built = built.PushBack(static_cast<int64_t>(j));
+            }
+            DoNotOptimize(built);
+        }
+    }) / size;
+    Report("vector/persistent_build", ours, theirs);
+}
+
+void BenchMap(size_t size) {
+    std::vector<size_t> indices = RandomIndices(size);
+    size_t mask = indices.size() - 1;
+
+    std::unordered_map<size_t, int64_t> std_map;
+    TransientMap<size_t, int64_t> builder;
+    for (size_t i = 0; i < size; ++i) {
+        std_map[i] = 0;
+        builder.Set(i, 0);
+    }
+    PersistentMap<size_t, int64_t> map = std::move(builder).Persistent();
+
+    double ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            PersistentMap<size_t, int64_t> snapshot = map;
+            map = snapshot.Set(indices[i & mask], i);
+            DoNotOptimize(snapshot);
+        }
+    });
+    double theirs = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::unordered_map<size_t, int64_t> snapshot = std_map;
+            std_map[indices[i & mask]] = i;
+            DoNotOptimize(snapshot);
+        }
+    });
+    Report("map/snapshot_set", ours, theirs);
+
+    ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            DoNotOptimize(map.Find(indices[i & mask]));
+        }
+    });
+    theirs = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            DoNotOptimize(std_map.find(indices[i & mask]));
+        }
+    });
+    Report("map/find", ours, theirs);
+
+    ours = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            TransientMap<size_t, int64_t> built;
+            for (size_t j = 0; j < size; ++j) {
+                built.Set(j, static_cast<int64_t>(j));
+            }
+            DoNotOptimize(std::move(built).Persistent());
+        }
+    }) / size;
+    theirs = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            std::unordered_map<size_t, int64_t> built;
+            for (size_t j = 0; j < size; ++j) {
+                built[j] = static_cast<int64_t>(j);
+            }
+            DoNotOptimize(built);
+        }
+    }) / size;
+    Report("map/transient_build", ours, theirs);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t size = 100'000;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [--size N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (size == 0) {
+        std::fprintf(stderr, "--size must be positive\n");
+        return 2;
+    }
+
+    std::printf("%zu elements\n", size);
+    std::printf("%-22s %14s %14s %10s\n", "benchmark", "ours ns/op", "std ns/op", "speedup");
+    BenchVector(size);
+    BenchMap(size);
+}
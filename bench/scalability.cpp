@@ -0,0 +1,482 @@
+// Multi-threaded contention harness for reference counting.
+//
+// Every worker runs one operation (`shared_copy`, `weak_lock`, `intrusive_copy`, `cache_get`
+// on a `WeakCache`, or `std_shared_copy` as a reference) on objects picked by a sharing
+// pattern:
+//   hot      all threads hit one object
+//   zipf     objects drawn from a Zipf distribution over `--objects` objects
+//   private  every thread owns its object (objects live on separate cache lines)
+//
+// Throughput counts every operation; latency is sampled on one operation out of
+// `kSampleEvery` to keep the clock out of the hot loop. After each run the counters of all
+// objects and the cache are checked, so building with -fsanitize=thread (SMART_PTRS_TSAN=ON)
+// turns the harness into a stress test of the counter protocols and of `WeakCache`.
+//
+// Usage: scalability_bench [--threads 1,2,4] [--pattern hot|zipf|private|all]
+//                          [--op NAME|all] [--duration-ms MS] [--objects N] [--zipf-s S]
+//                          [--pin] [--json FILE]
+
+#ifndef SMART_PTRS_ATOMIC_COUNTERS
+#error "scalability_bench needs SMART_PTRS_ATOMIC_COUNTERS"
+#endif
+
+#include "bench_util.h"
+#include "intrusive.h"
+#include "shared.h"
+#include "weak.h"
+#include "weak_cache.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr int64_t kSampleEvery = 16;
+constexpr size_t kIndexRing = 1 << 14;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Latency histogram: exact below 128 ns, 64 sub-buckets per power of two above
+
+class LatencyHistogram {
+    static constexpr int kExact = 128;
+    static constexpr int kSubBuckets = 64;
+    static constexpr int kBuckets = kExact + 40 * kSubBuckets;
+
+public:
+    void Record(uint64_t ns) {
+        ++counts_[Bucket(ns)];
+        ++total_;
+    }
+
+    void Merge(const LatencyHistogram& other) {
+        for (int i = 0; i < kBuckets; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+    }
+
+    // Lower bound of the bucket holding the `quantile`-th sample
+    uint64_t Percentile(double quantile) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        auto rank = static_cast<uint64_t>(std::ceil(quantile * total_));
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            seen += counts_[i];
+            if (seen >= rank && counts_[i] != 0) {
+                return LowerBound(i);
+            }
+        }
+        return LowerBound(kBuckets - 1);
+    }
+
+private:
+    static int Log2(uint64_t value) {
+        return 63 - __builtin_clzll(value);
+    }
+
+    static int Bucket(uint64_t ns) {
+        if (ns < kExact) {
+            return static_cast<int>(ns);
+        }
+        int power = Log2(ns);
+        int sub = static_cast<int>((ns >> (power - 6)) & (kSubBuckets - 1));
+        int bucket = kExact + (power - 7) * kSubBuckets + sub;
+        return std::min(bucket, kBuckets - 1);
+    }
+
+    static uint64_t LowerBound(int bucket) {
+        if (bucket < kExact) {
+            return bucket;
+        }
+        int power = (bucket - kExact) / kSubBuckets + 7;
+        uint64_t sub = (bucket - kExact) % kSubBuckets;
+        return (uint64_t{1} << power) + (sub << (power - 6));
+    }
+
+    std::vector<uint64_t> counts_ = std::vector<uint64_t>(kBuckets);
+    uint64_t total_ = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Objects under test
+
+struct Payload {
+    int64_t value = 0;
+};
+
+// Padded so that "private" objects never share a cache line
+struct alignas(kCacheLineSize) PaddedNode : AtomicRefCounted<PaddedNode> {
+    int64_t value = 0;
+};
+
+struct Objects {
+    std::vector<SharedPtr<Payload>> shared;
+    std::vector<WeakPtr<Payload>> weak;
+    std::vector<IntrusivePtr<PaddedNode>> intrusive;
+    std::vector<std::shared_ptr<Payload>> std_shared;
+    // Values of odd keys are kept alive and always hit; even keys expire after every lookup,
+    // so their values are created again and again, racing with their own unregistration
+    mutable WeakCache<size_t, Payload> cache;
+    std::vector<SharedPtr<Payload>> cached;
+
+    explicit Objects(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            shared.push_back(MakeSharedWithLayout<Payload, PaddedLayout>());
+            weak.emplace_back(shared.back());
+            intrusive.push_back(MakeIntrusive<PaddedNode>());
+            std_shared.push_back(std::make_shared<Payload>());
+            if (i % 2 == 1) {
+                cached.push_back(cache.GetOrCreate(i, [] { return Payload{}; }));
+            }
+        }
+    }
+
+    // Every object must be back to its owners only, and the cache must hold exactly the
+    // values still owned
+    bool Consistent() const {
+        for (size_t i = 0; i < shared.size(); ++i) {
+            if (shared[i].UseCount() != 1 || intrusive[i].UseCount() != 1 ||
+                std_shared[i].use_count() != 1 || weak[i].Expired()) {
+                return false;
+            }
+        }
+        for (const SharedPtr<Payload>& value : cached) {
+            if (value.UseCount() != 1) {
+                return false;
+            }
+        }
+        return cache.Size() == cached.size();
+    }
+};
+
+enum class Operation { kSharedCopy, kWeakLock, kIntrusiveCopy, kCacheGet, kStdSharedCopy };
+
+const char* Name(Operation operation) {
+    switch (operation) {
+        case Operation::kSharedCopy:
+            return "shared_copy";
+        case Operation::kWeakLock:
+            return "weak_lock";
+        case Operation::kIntrusiveCopy:
+            return "intrusive_copy";
+        case Operation::kCacheGet:
+            return "cache_get";
+        case Operation::kStdSharedCopy:
+            return "std_shared_copy";
+    }
+    return "";
+}
+
+inline void RunOnce(Operation operation, const Objects& objects, size_t index) {
+    switch (operation) {
+        case Operation::kSharedCopy: {
+            SharedPtr<Payload> copy(objects.shared[index]);
+            Escape(&copy);
+            break;
+        }
+        case Operation::kWeakLock: {
+            SharedPtr<Payload> locked = objects.weak[index].Lock();
+            Escape(&locked);
+            break;
+        }
+        case Operation::kIntrusiveCopy: {
+            IntrusivePtr<PaddedNode> copy(objects.intrusive[index]);
+            Escape(&copy);
+            break;
+        }
+        case Operation::kCacheGet: {
+            SharedPtr<Payload> value = objects.cache.GetOrCreate(index, [] { return Payload{}; });
+            Escape(&value);
+            break;
+        }
+        case Operation::kStdSharedCopy: {
+            std::shared_ptr<Payload> copy(objects.std_shared[index]);
+            Escape(&copy);
+            break;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sharing patterns
+
+enum class Pattern { kHot, kZipf, kPrivate };
+
+const char* Name(Pattern pattern) {
+    switch (pattern) {
+        case Pattern::kHot:
+            return "hot";
+        case Pattern::kZipf:
+            return "zipf";
+        case Pattern::kPrivate:
+            return "private";
+    }
+    return "";
+}
+
+// Pre-drawn object indices for one thread, so the hot loop does no random number generation
+std::vector<size_t> DrawIndices(Pattern pattern, size_t thread, size_t objects, double zipf_s) {
+    std::vector<size_t> indices(kIndexRing);
+    if (pattern == Pattern::kHot) {
+        std::fill(indices.begin(), indices.end(), 0);
+    } else if (pattern == Pattern::kPrivate) {
+        std::fill(indices.begin(), indices.end(), thread);
+    } else {
+        std::vector<double> weights(objects);
+        for (size_t i = 0; i < objects; ++i) {
+            weights[i] = 1.0 / std::pow(static_cast<double>(i + 1), zipf_s);
+        }
+        std::discrete_distribution<size_t> distribution(weights.begin(), weights.end());
+        std::mt19937_64 generator(thread + 1);
+        for (auto& index : indices) {
+            index = distribution(generator);
+        }
+    }
+    return indices;
+}
+
+void Pin(size_t thread) {
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(thread % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Runner
+
+struct Config {
+    std::vector<size_t> threads = {1, 2, 4, 8, 16, 32, 64};
+    std::vector<Pattern> patterns = {Pattern::kHot, Pattern::kZipf, Pattern::kPrivate};
+    std::vector<Operation> operations = {Operation::kSharedCopy, Operation::kWeakLock,
+                                         Operation::kIntrusiveCopy, Operation::kCacheGet,
+                                         Operation::kStdSharedCopy};
+    double duration_ms = 200;
+    size_t objects = 1024;
+    double zipf_s = 0.99;
+    bool pin = false;
+    const char* json_path = nullptr;
+};
+
+struct Result {
+    Operation operation;
+    Pattern pattern;
+    size_t threads;
+    double mops;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    bool consistent;
+};
+
+Result Run(const Config& config, Operation operation, Pattern pattern, size_t threads) {
+    size_t count = pattern == Pattern::kPrivate ? threads : config.objects;
+    Objects objects(count);
+
+    std::vector<std::vector<size_t>> indices;
+    for (size_t t = 0; t < threads; ++t) {
+        indices.push_back(DrawIndices(pattern, t, count, config.zipf_s));
+    }
+
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> stop{false};
+    std::vector<uint64_t> operations(threads);
+    std::vector<LatencyHistogram> histograms(threads);
+    std::vector<std::thread> workers;
+
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            if (config.pin) {
+                Pin(t);
+            }
+            const std::vector<size_t>& ring = indices[t];
+            LatencyHistogram& histogram = histograms[t];
+            ready.fetch_add(1);
+            while (ready.load() < threads + 1) {
+            }
+
+            uint64_t done = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int64_t i = 0; i < kSampleEvery - 1; ++i) {
+                    RunOnce(operation, objects, ring[done++ % kIndexRing]);
+                }
+                double begin = NowNs();
+                RunOnce(operation, objects, ring[done++ % kIndexRing]);
+                histogram.Record(static_cast<uint64_t>(NowNs() - begin));
+            }
+            operations[t] = done;
+        });
+    }
+
+    while (ready.load() < threads) {
+    }
+    double begin = NowNs();
+    ready.fetch_add(1);
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(config.duration_ms));
+    stop.store(true);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double elapsed = NowNs() - begin;
+
+    LatencyHistogram merged;
+    uint64_t total = 0;
+    for (size_t t = 0; t < threads; ++t) {
+        merged.Merge(histograms[t]);
+        total += operations[t];
+    }
+    return {operation,
+            pattern,
+            threads,
+            total / elapsed * 1e3,
+            merged.Percentile(0.5),
+            merged.Percentile(0.99),
+            merged.Percentile(0.999),
+            objects.Consistent()};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Command line
+
+std::vector<size_t> ParseList(const char* text) {
+    std::vector<size_t> values;
+    std::string item;
+    for (const char* c = text;; ++c) {
+        if (*c == ',' || *c == '\0') {
+            if (!item.empty()) {
+                values.push_back(std::stoul(item));
+            }
+            item.clear();
+            if (*c == '\0') {
+                break;
+            }
+        } else {
+            item += *c;
+        }
+    }
+    return values;
+}
+
+void Usage(const char* program) {
+    std::fprintf(stderr,
+                 "usage: %s [--threads 1,2,4] [--pattern hot|zipf|private|all] "
+                 "[--op shared_copy|weak_lock|intrusive_copy|cache_get|std_shared_copy|all] "
+                 "[--duration-ms MS] [--objects N] [--zipf-s S] [--pin] [--json FILE]\n",
+                 program);
+    std::exit(2);
+}
+
+Config Parse(int argc, char** argv) {
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        bool has_value = i + 1 < argc;
+        if (flag == "--threads" && has_value) {
+            config.threads = ParseList(argv[++i]);
+        } else if (flag == "--pattern" && has_value) {
+            std::string value = argv[++i];
+            if (value != "all") {
+                config.patterns.clear();
+                for (Pattern pattern : {Pattern::kHot, Pattern::kZipf, Pattern::kPrivate}) {
+                    if (value == Name(pattern)) {
+                        config.patterns.push_back(pattern);
+                    }
+                }
+            }
+        } else if (flag == "--op" && has_value) {
+            std::string value = argv[++i];
+            if (value != "all") {
+                config.operations.clear();
+                for (Operation operation :
+                     {Operation::kSharedCopy, Operation::kWeakLock, Operation::kIntrusiveCopy,
+                      Operation::kCacheGet, Operation::kStdSharedCopy}) {
+                    if (value == Name(operation)) {
+                        config.operations.push_back(operation);
+                    }
+                }
+            }
+        } else if (flag == "--duration-ms" && has_value) {
+            config.duration_ms = std::atof(argv[++i]);
+        } else if (flag == "--objects" && has_value) {
+            config.objects = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (flag == "--zipf-s" && has_value) {
+            config.zipf_s = std::atof(argv[++i]);
+        } else if (flag == "--pin") {
+            config.pin = true;
+        } else if (flag == "--json" && has_value) {
+            config.json_path = argv[++i];
+        } else {
+            Usage(argv[0]);
+        }
+    }
+    if (config.threads.empty() || config.patterns.empty() || config.operations.empty()) {
+        Usage(argv[0]);
+    }
+    return config;
+}
+
+void WriteJson(const char* path, const std::vector<Result>& results) {
+    FILE* out = std::fopen(path, "w");
+    if (out == nullptr) {
+        std::perror(path);
+        std::exit(1);
+    }
+    std::fprintf(out, "{\n  \"scalability\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        std::fprintf(out,
+                     "    {\"op\": \"%s\", \"pattern\": \"%s\", \"threads\": %zu, "
+                     "\"mops\": %.3f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}%s\n",
+                     Name(r.operation), Name(r.pattern), r.threads, r.mops,
+                     static_cast<unsigned long long>(r.p50), static_cast<unsigned long long>(r.p99),
+                     static_cast<unsigned long long>(r.p999), i + 1 == results.size() ? "" : ",");
+    }
+    std::fprintf(out, "  ]\n}\n");
+    std::fclose(out);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Config config = Parse(argc, argv);
+
+    std::vector<Result> results;
+    bool consistent = true;
+    std::printf("%-16s %-8s %7s %10s %8s %8s %8s\n", "op", "pattern", "threads", "Mops/s",
+                "p50 ns", "p99 ns", "p999 ns");
+    for (Operation operation : config.operations) {
+        for (Pattern pattern : config.patterns) {
+            for (size_t threads : config.threads) {
+                Result r = Run(config, operation, pattern, threads);
+                std::printf("%-16s %-8s %7zu %10.2f %8llu %8llu %8llu%s\n", Name(operation),
+                            Name(pattern), threads, r.mops, static_cast<unsigned long long>(r.p50),
+                            static_cast<unsigned long long>(r.p99),
+                            static_cast<unsigned long long>(r.p999),
+                            r.consistent ? "" : "  COUNTERS CORRUPTED");
+                consistent = consistent && r.consistent;
+                results.push_back(r);
+            }
+        }
+    }
+
+    if (config.json_path != nullptr) {
+        WriteJson(config.json_path, results);
+    }
+    return consistent ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+// Object graphs in a `Segment`: a linked list of `OffsetSharedPtr` nodes is built in shared
+// memory, walked and extended by a forked child that maps it at its own address, then built in
+// a file and walked again through a copy-on-write snapshot.
+//
+// Usage: segment_bench [--nodes N]
+
+#include "bench_util.h"
+#include "segment.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+
+namespace {
+
+struct Node {
+    int64_t value;
+    OffsetSharedPtr<Node> next;
+};
+
+// Builds the list `count - 1, ..., 1, 0` and makes it the root
+void Build(Segment& segment, int64_t count) {
+    double start = NowNs();
+    OffsetSharedPtr<Node> head;
+    for (int64_t i = 0; i < count; ++i) {
+        head = MakeOffsetShared<Node>(segment, Node{i, std::move(head)});
+    }
+    segment.SetRoot(head);
+    std::printf("%-28s %12.2f\n", "build", (NowNs() - start) / count);
+}
+
+// Sum of the values reachable from the root
+int64_t Walk(Segment& segment, const char* name, int64_t count) {
+    double start = NowNs();
+    int64_t sum = 0;
+    OffsetSharedPtr<Node> root = segment.GetRoot<Node>();
+    for (const Node* node = root.Get(); node != nullptr; node = node->next.Get()) {
+        sum += node->value;
+    }
+    DoNotOptimize(sum);
+    std::printf("%-28s %12.2f\n", name, (NowNs() - start) / count);
+    return sum;
+}
+
+bool RunShared(int64_t count, size_t size) {
+    std::string name = "/segment_bench." + std::to_string(::getpid());
+    int64_t expected = count * (count - 1) / 2;
+    bool ok = false;
+    {
+        MappedSegment segment = MappedSegment::CreateShared(name, size);
+        Build(*segment, count);
+
+        std::fflush(stdout);
+        pid_t child = ::fork();
+        if (child == 0) {
+            // Fresh mapping at an address of the child's choosing
+            MappedSegment attached = MappedSegment::OpenShared(name);
+            bool child_ok = Walk(*attached, "walk from forked child", count) == expected;
+            OffsetSharedPtr<Node> head = attached->GetRoot<Node>();
+            attached->SetRoot(MakeOffsetShared<Node>(*attached, Node{count, std::move(head)}));
+            std::fflush(stdout);
+            ::_exit(child_ok ? 0 : 1);
+        }
+        int status = 0;
+        ::waitpid(child, &status, 0);
+        ok = child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        // The child's new head is visible to the parent
+        ok = ok && Walk(*segment, "walk after child push", count + 1) == expected + count;
+    }
+    MappedSegment::RemoveShared(name);
+    return ok;
+}
+
+bool RunSnapshot(int64_t count, size_t size) {
+    char path[] = "/tmp/segment_bench.XXXXXX";
+    int fd = ::mkstemp(path);
+    if (fd < 0) {
+        return false;
+    }
+    ::close(fd);
+    int64_t expected = count * (count - 1) / 2;
+    {
+        MappedSegment segment = MappedSegment::CreateFile(path, size);
+        Build(*segment, count);
+    }
+    bool ok = false;
+    {
+        MappedSegment snapshot = MappedSegment::OpenSnapshot(path);
+        ok = Walk(*snapshot, "walk snapshot", count) == expected;
+        // Copy-on-write: the push stays in this mapping
+        OffsetSharedPtr<Node> head = snapshot->GetRoot<Node>();
+        snapshot->SetRoot(MakeOffsetShared<Node>(*snapshot, Node{count, std::move(head)}));
+        ok = ok && Walk(*snapshot, "walk pushed snapshot", count + 1) == expected + count;
+    }
+    {
+        MappedSegment snapshot = MappedSegment::OpenSnapshot(path);
+        ok = ok && Walk(*snapshot, "walk snapshot again", count) == expected;
+    }
+    ::unlink(path);
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int64_t count = 100000;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) {
+            count = std::strtoll(argv[++i], nullptr, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [--nodes N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (count <= 0) {
+        std::fprintf(stderr, "--nodes must be positive\n");
+        return 2;
+    }
+
+    // Nodes take 32-byte blocks; leave room for the child's push
+    size_t size = static_cast<size_t>(count + 1) * 64 + (size_t{1} << 20);
+    std::printf("%lld nodes\n", static_cast<long long>(count));
+    std::printf("%-28s %12s\n", "phase", "ns/node");
+    if (!RunShared(count, size)) {
+        std::fprintf(stderr, "shared segment check failed\n");
+        return 1;
+    }
+    if (!RunSnapshot(count, size)) {
+        std::fprintf(stderr, "snapshot check failed\n");
+        return 1;
+    }
+}
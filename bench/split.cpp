@@ -0,0 +1,137 @@
+// Memory held by objects that are only observed through weak pointers, and the allocation cost
+// of each `MakeShared` layout. Every object gets one weak pointer, then its last strong
+// reference is dropped: a single-allocation block keeps the whole object resident, a split one
+// keeps only its counters.
+//
+// Usage: split_bench [--objects N]
+
+#include "bench_util.h"
+#include "shared.h"
+#include "weak.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation counting
+
+namespace {
+
+// Each allocation is prefixed with its size, so frees can be subtracted from the live total
+constexpr size_t kHeader = alignof(std::max_align_t);
+
+uint64_t allocations = 0;
+size_t live_bytes = 0;
+
+}  // namespace
+
+// Kept out of line: inlined into a caller, GCC reports -Wuse-after-free on the counters of
+// blocks freed through these functions
+[[gnu::noinline]] void* operator new(size_t size) {
+    auto* memory = static_cast<unsigned char*>(std::malloc(kHeader + size));
+    if (memory == nullptr) {
+        throw std::bad_alloc{};
+    }
+    *reinterpret_cast<size_t*>(memory) = size;
+    ++allocations;
+    live_bytes += size;
+    return memory + kHeader;
+}
+
+[[gnu::noinline]] void operator delete(void* memory) noexcept {
+    if (memory == nullptr) {
+        return;
+    }
+    auto* header = static_cast<unsigned char*>(memory) - kHeader;
+    live_bytes -= *reinterpret_cast<size_t*>(header);
+    std::free(header);
+}
+
+[[gnu::noinline]] void operator delete(void* memory, size_t) noexcept {
+    operator delete(memory);
+}
+
+namespace {
+
+template <size_t Bytes>
+struct Blob {
+    unsigned char data[Bytes];
+};
+
+template <typename T>
+WeakPtr<T> Weaken(const SharedPtr<T>& ptr) {
+    return WeakPtr<T>(ptr);
+}
+
+template <typename T>
+std::weak_ptr<T> Weaken(const std::shared_ptr<T>& ptr) {
+    return std::weak_ptr<T>(ptr);
+}
+
+template <typename Make>
+void Run(const char* policy, size_t objects, Make make) {
+    double ns = MeasureNsPerOp([&](int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            auto ptr = make();
+            Escape(&ptr);
+        }
+    });
+    uint64_t allocations_before = allocations;
+    {
+        auto ptr = make();
+        Escape(&ptr);
+    }
+    uint64_t allocs = allocations - allocations_before;
+
+    size_t bytes_before = live_bytes;
+    std::vector<decltype(Weaken(make()))> observers;
+    observers.reserve(objects);
+    size_t reserved = live_bytes - bytes_before;
+    for (size_t i = 0; i < objects; ++i) {
+        observers.push_back(Weaken(make()));
+    }
+    double retained = static_cast<double>(live_bytes - bytes_before - reserved) / objects;
+    std::printf("  %-28s %10.1f %10llu %16.1f\n", policy, ns,
+                static_cast<unsigned long long>(allocs), retained);
+}
+
+template <size_t Bytes>
+void RunSize(size_t objects) {
+    using T = Blob<Bytes>;
+    std::printf("%zu-byte objects\n", Bytes);
+    Run("MakeShared", objects, [] { return MakeShared<T>(); });
+    Run("MakeSharedSplit", objects, [] { return MakeSharedSplit<T>(); });
+    Run("SplitAboveLayout<4096>", objects,
+        [] { return MakeSharedWithLayout<T, SplitAboveLayout<4096>>(); });
+    Run("std::make_shared", objects, [] { return std::make_shared<T>(); });
+    Run("std::shared_ptr(new T)", objects, [] { return std::shared_ptr<T>(new T()); });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t objects = 1000;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--objects") == 0 && i + 1 < argc) {
+            objects = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [--objects N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (objects == 0) {
+        std::fprintf(stderr, "--objects must be positive\n");
+        return 2;
+    }
+
+    std::printf("  %-28s %10s %10s %16s\n", "policy", "ns/make", "allocs", "retained B/obj");
+    RunSize<64>(objects);
+    RunSize<4096>(objects);
+    RunSize<65536>(objects);
+}
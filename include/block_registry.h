@@ -0,0 +1,249 @@
+#pragma once
+
+// Debug registry of live `ControlBlock`s.
+//
+// Define SMART_PTRS_BLOCK_REGISTRY (CMake option of the same name) to link every live control
+// block into one of several mutex-guarded intrusive lists. `block_registry::Dump()` prints the
+// live blocks grouped by type and creation site with their strong and weak counts, and flags
+// blocks whose object is gone but whose memory, which includes the storage of the destroyed
+// object, is still held by `WeakPtr`s (`MakeShared` and `MakeSharedBatch` blocks).
+//
+// Creation sites are sampled call stacks: `block_registry::SetStackSampling(n)` records the
+// stack of every n-th block (0, the default, records none). Only sampled blocks allocate room
+// for a stack. Link with -rdynamic to get function names in the dump.
+
+#ifdef SMART_PTRS_BLOCK_REGISTRY
+
+#include <cxxabi.h>
+#include <execinfo.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+namespace block_registry {
+
+inline constexpr size_t kShards = 16;
+// Frames kept per sampled stack. The innermost ones belong to the pointer library itself
+// unless it was inlined into the caller.
+inline constexpr int kStackDepth = 10;
+
+inline std::atomic<size_t> stack_sampling{0};
+inline std::atomic<size_t> sample_counter{0};
+
+inline void SetStackSampling(size_t every) {
+    stack_sampling.store(every, std::memory_order_relaxed);
+}
+
+class Entry;
+
+// Live block as seen by `LiveBlocks`, with the mangled type name until it returns
+struct BlockInfo {
+    std::string type;
+    size_t strong = 0;
+    size_t weak = 0;
+    // Memory held right now: the block, plus the object if it lives outside the block
+    size_t bytes = 0;
+    // The object was constructed inside the block, so its storage lives as long as the block
+    bool object_in_block = false;
+    std::vector<void*> stack;
+
+    // The object is destroyed, but `WeakPtr`s keep the block and with it the object's storage
+    bool ExpiredButRetained() const {
+        return strong == 0 && object_in_block;
+    }
+};
+
+inline std::vector<BlockInfo> LiveBlocks();
+
+// Reads the strong and weak counters of the block owning an entry
+using CountReader = void (*)(const void* owner, size_t* strong, size_t* weak);
+
+struct Shard {
+    std::mutex mutex;
+    Entry* head = nullptr;
+};
+
+inline Shard* Shards() {
+    static Shard shards[kShards];
+    return shards;
+}
+
+// Threads are spread over the shards round-robin, so creation rarely contends
+inline Shard& CurrentShard() {
+    static std::atomic<size_t> next_thread{0};
+    thread_local size_t index = next_thread.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return Shards()[index];
+}
+
+// Member of `ControlBlock`: linked into a shard while the block is alive
+class Entry {
+    friend std::vector<BlockInfo> LiveBlocks();
+
+public:
+    Entry() = default;
+    Entry(const Entry&) = delete;
+    Entry& operator=(const Entry&) = delete;
+
+    ~Entry() {
+        if (shard_ == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(shard_->mutex);
+        if (prev_ != nullptr) {
+            prev_->next_ = next_;
+        } else {
+            shard_->head = next_;
+        }
+        if (next_ != nullptr) {
+            next_->prev_ = prev_;
+        }
+    }
+
+    // `block_bytes` stay allocated until the block dies, `object_bytes` are freed with the
+    // object (separately allocated pointees). `object_in_block` is set when the object's
+    // storage is part of `block_bytes`.
+    void Register(const std::type_info& type, const void* owner, CountReader counts,
+                  size_t block_bytes, size_t object_bytes, bool object_in_block) {
+        type_ = &type;
+        owner_ = owner;
+        counts_ = counts;
+        block_bytes_ = block_bytes;
+        object_bytes_ = object_bytes;
+        object_in_block_ = object_in_block;
+
+        size_t every = stack_sampling.load(std::memory_order_relaxed);
+        if (every != 0 && sample_counter.fetch_add(1, std::memory_order_relaxed) % every == 0) {
+            stack_.reset(new void*[kStackDepth]);
+            stack_depth_ = ::backtrace(stack_.get(), kStackDepth);
+        }
+
+        Shard& shard = CurrentShard();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard_ = &shard;
+        next_ = shard.head;
+        if (next_ != nullptr) {
+            next_->prev_ = this;
+        }
+        shard.head = this;
+    }
+
+private:
+    BlockInfo Describe() const {
+        BlockInfo info;
+        info.type = type_->name();
+        counts_(owner_, &info.strong, &info.weak);
+        info.bytes = block_bytes_ + (info.strong != 0 ? object_bytes_ : 0);
+        info.object_in_block = object_in_block_;
+        info.stack.assign(stack_.get(), stack_.get() + stack_depth_);
+        return info;
+    }
+
+    Shard* shard_ = nullptr;
+    Entry* prev_ = nullptr;
+    Entry* next_ = nullptr;
+    const std::type_info* type_ = nullptr;
+    const void* owner_ = nullptr;
+    CountReader counts_ = nullptr;
+    size_t block_bytes_ = 0;
+    size_t object_bytes_ = 0;
+    bool object_in_block_ = false;
+    // Allocated for sampled blocks only
+    std::unique_ptr<void*[]> stack_;
+    int stack_depth_ = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reports
+
+inline std::string Demangle(const char* name) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status != 0 || demangled == nullptr) {
+        return name;
+    }
+    std::string result = demangled;
+    std::free(demangled);
+    return result;
+}
+
+inline std::vector<BlockInfo> LiveBlocks() {
+    std::vector<BlockInfo> blocks;
+    for (size_t i = 0; i < kShards; ++i) {
+        Shard& shard = Shards()[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const Entry* entry = shard.head; entry != nullptr; entry = entry->next_) {
+            blocks.push_back(entry->Describe());
+        }
+    }
+    // Outside the locks: demangling allocates
+    for (BlockInfo& info : blocks) {
+        info.type = Demangle(info.type.c_str());
+    }
+    return blocks;
+}
+
+struct Group {
+    size_t blocks = 0;
+    size_t bytes = 0;
+    size_t strong = 0;
+    size_t weak = 0;
+    size_t expired = 0;
+    size_t expired_bytes = 0;
+};
+
+// Live blocks grouped by type and creation site, largest groups first
+inline void Dump(std::FILE* out = stderr) {
+    using Key = std::pair<std::string, std::vector<void*>>;
+    std::map<Key, Group> groups;
+    for (const BlockInfo& info : LiveBlocks()) {
+        Group& group = groups[{info.type, info.stack}];
+        ++group.blocks;
+        group.bytes += info.bytes;
+        group.strong += info.strong;
+        group.weak += info.weak;
+        if (info.ExpiredButRetained()) {
+            ++group.expired;
+            group.expired_bytes += info.bytes;
+        }
+    }
+
+    std::vector<std::pair<Key, Group>> sorted(groups.begin(), groups.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& left, const auto& right) {
+        return std::tie(left.second.bytes, left.second.blocks) >
+               std::tie(right.second.bytes, right.second.blocks);
+    });
+
+    std::fprintf(out, "%8s %12s %10s %10s  %s\n", "blocks", "bytes", "strong", "weak", "type");
+    for (const auto& [key, group] : sorted) {
+        std::fprintf(out, "%8zu %12zu %10zu %10zu  %s\n", group.blocks, group.bytes, group.strong,
+                     group.weak, key.first.c_str());
+        if (group.expired != 0) {
+            std::fprintf(out,
+                         "         ^ %zu expired but retained by weak refs, holding %zu bytes\n",
+                         group.expired, group.expired_bytes);
+        }
+        if (!key.second.empty()) {
+            char** symbols =
+                ::backtrace_symbols(key.second.data(), static_cast<int>(key.second.size()));
+            for (size_t i = 0; i < key.second.size(); ++i) {
+                std::fprintf(out, "             at %s\n", symbols != nullptr ? symbols[i] : "?");
+            }
+            std::free(symbols);
+        }
+    }
+}
+
+}  // namespace block_registry
+
+#endif  // SMART_PTRS_BLOCK_REGISTRY
@@ -1,120 +1,120 @@
 #pragma once
 
-#include <iostream>
+#include <cstddef>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 
+// Tuple whose empty, non-final members take no space (empty base optimization). Every special
+// member is defaulted, so the tuple is trivially copyable, movable or destructible exactly when
+// all of its members are, and usable in constant expressions.
+
 template <typename V>
 inline constexpr bool kIsCompressedV = std::is_empty_v<V> && !std::is_final_v<V>;
 
-template <typename T, bool IsFirst, bool IsCompressed = kIsCompressedV<T>>
-class CompressedPairElement {
+// `Index` keeps two members of the same type distinct bases
+template <size_t Index, typename T, bool IsCompressed = kIsCompressedV<T>>
+class CompressedTupleElement {
 public:
-    CompressedPairElement() = default;
-
-    // CompressedPairElement(T other) {
-    //     if constexpr (std::is_copy_assignable_v<T>) {
-    //         value_ = other;
-    //     }
-    // }
-
-    CompressedPairElement(const T& other) {
-        if constexpr (std::is_copy_assignable_v<T>) {
-            value_ = other;
-        }
-    }
+    constexpr CompressedTupleElement() = default;
 
-    CompressedPairElement(T& other) {
-        std::cout << "Link\n";
-        if constexpr (std::is_copy_assignable_v<T>) {
-            value_ = other;
-        } else if constexpr (std::is_move_assignable_v<T>) {
-            value_ = std::forward<T>(other);
-        }
+    template <typename U>
+    constexpr explicit CompressedTupleElement(U&& value) : value_(std::forward<U>(value)) {
     }
 
-    CompressedPairElement(T&& value) : value_(std::forward<T>(value)) {
-    }
-
-    T& Get() {
+    constexpr T& Get() noexcept {
         return value_;
     }
 
-    const T& Get() const {
+    constexpr const T& Get() const noexcept {
         return value_;
     }
 
 private:
-    T value_;
+    T value_{};
 };
 
-template <typename T, bool IsFirst>
-class CompressedPairElement<T, IsFirst, true> : T {
+template <size_t Index, typename T>
+class CompressedTupleElement<Index, T, true> : T {
 public:
-    CompressedPairElement() = default;
-
-    CompressedPairElement(const T& other) : T(other) {
-    }
+    constexpr CompressedTupleElement() = default;
 
-    CompressedPairElement(T&&) {
+    template <typename U>
+    constexpr explicit CompressedTupleElement(U&& value) : T(std::forward<U>(value)) {
     }
 
-    T& Get() {
+    constexpr T& Get() noexcept {
         return *this;
     }
 
-    const T& Get() const {
+    constexpr const T& Get() const noexcept {
         return *this;
     }
 };
 
-template <typename F, typename S>
-class CompressedPair : CompressedPairElement<F, true>, CompressedPairElement<S, false> {
-    using FirstElement = CompressedPairElement<F, true>;
-    using SecondElement = CompressedPairElement<S, false>;
+template <typename Indices, typename... Ts>
+class CompressedTupleBase;
 
+template <size_t... Indices, typename... Ts>
+class CompressedTupleBase<std::index_sequence<Indices...>, Ts...>
+    : CompressedTupleElement<Indices, Ts>... {
 public:
-    CompressedPair() = default;
+    constexpr CompressedTupleBase() = default;
 
-    CompressedPair(CompressedPair&& other)
-        : FirstElement(std::forward<F>(other.GetFirst())),
-          SecondElement(std::forward<S>(other.GetSecond())) {
+    // One argument per member, each forwarded to the member's constructor
+    template <typename... Us>
+    constexpr explicit CompressedTupleBase(std::in_place_t, Us&&... values)
+        : CompressedTupleElement<Indices, Ts>(std::forward<Us>(values))... {
     }
 
-    CompressedPair& operator=(CompressedPair&& other) {
-        FirstElement::Get() = std::forward<F>(other.GetFirst());
-        SecondElement::Get() = std::forward<S>(other.GetSecond());
-        return *this;
+    template <size_t I>
+    constexpr auto& Get() noexcept {
+        return static_cast<Element<I>&>(*this).Get();
     }
 
-    CompressedPair(const F& first, const S& second) : FirstElement(first), SecondElement(second) {
+    template <size_t I>
+    constexpr const auto& Get() const noexcept {
+        return static_cast<const Element<I>&>(*this).Get();
     }
 
-    CompressedPair(F&& first, const S& second)
-        : FirstElement(std::forward<F>(first)), SecondElement(second) {
-    }
+private:
+    template <size_t I>
+    using Element = CompressedTupleElement<I, std::tuple_element_t<I, std::tuple<Ts...>>>;
+};
 
-    CompressedPair(const F& first, S&& second)
-        : FirstElement(first), SecondElement(std::forward<S>(second)) {
-    }
+template <typename... Ts>
+class CompressedTuple : public CompressedTupleBase<std::index_sequence_for<Ts...>, Ts...> {
+    using Base = CompressedTupleBase<std::index_sequence_for<Ts...>, Ts...>;
 
-    CompressedPair(F&& first, S&& second)
-        : FirstElement(std::forward<F>(first)), SecondElement(std::forward<S>(second)) {
+public:
+    constexpr CompressedTuple() = default;
+
+    template <typename... Us,
+              typename = std::enable_if_t<sizeof...(Us) == sizeof...(Ts) && sizeof...(Us) != 0 &&
+                                          (std::is_constructible_v<Ts, Us&&> && ...)>>
+    constexpr CompressedTuple(Us&&... values) : Base(std::in_place, std::forward<Us>(values)...) {
     }
+};
 
-    F& GetFirst() {
-        return FirstElement::Get();
+// Pointer-and-deleter storage of `UniquePtr`
+template <typename F, typename S>
+class CompressedPair : public CompressedTuple<F, S> {
+public:
+    using CompressedTuple<F, S>::CompressedTuple;
+
+    constexpr F& GetFirst() noexcept {
+        return this->template Get<0>();
     }
 
-    const F& GetFirst() const {
-        return FirstElement::Get();
+    constexpr const F& GetFirst() const noexcept {
+        return this->template Get<0>();
     }
 
-    S& GetSecond() {
-        return SecondElement::Get();
+    constexpr S& GetSecond() noexcept {
+        return this->template Get<1>();
     }
 
-    const S& GetSecond() const {
-        return SecondElement::Get();
-    };
-};
\ No newline at end of file
+    constexpr const S& GetSecond() const noexcept {
+        return this->template Get<1>();
+    }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "shared.h"
+
+#include <utility>
+
+// Copy-on-write value: copies share one `SharedPtr<T>` and the value is cloned on the first
+// `Mutate()` of a copy whose object is shared. Reads go through the raw pointer and never touch
+// the counter.
+//
+// With SMART_PTRS_ATOMIC_COUNTERS defined, copies may be handed to other threads: a writer sees
+// `UseCount() == 1` only after every other copy is released, and the acquire load of the
+// counter orders their reads of the old object before its writes. A single `CowPtr` object is
+// not itself synchronized, like any other value.
+template <typename T>
+class CowPtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    CowPtr() : ptr_(MakeShared<T>()) {
+    }
+
+    CowPtr(const T& value) : ptr_(MakeShared<T>(value)) {
+    }
+
+    CowPtr(T&& value) : ptr_(MakeShared<T>(std::move(value))) {
+    }
+
+    // Constructs the value from `args`
+    template <typename... Args>
+    explicit CowPtr(std::in_place_t, Args&&... args)
+        : ptr_(MakeShared<T>(std::forward<Args>(args)...)) {
+    }
+
+    // A moved-from `CowPtr` may only be assigned to or destroyed
+    CowPtr(const CowPtr& other) = default;
+    CowPtr(CowPtr&& other) = default;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    CowPtr& operator=(const CowPtr& other) = default;
+    CowPtr& operator=(CowPtr&& other) = default;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // Clones the value first if other copies share it
+    T& Mutate() {
+        if (ptr_.UseCount() != 1) {
+            ptr_ = MakeShared<T>(std::as_const(*ptr_));
+        }
+        return *ptr_;
+    }
+
+    void Swap(CowPtr& other) {
+        ptr_.Swap(other.ptr_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    const T& Read() const {
+        return *ptr_;
+    }
+
+    const T& operator*() const {
+        return *ptr_;
+    }
+
+    const T* operator->() const {
+        return ptr_.Get();
+    }
+
+    // Number of copies sharing the value
+    size_t UseCount() const {
+        return ptr_.UseCount();
+    }
+
+    bool IsShared() const {
+        return ptr_.UseCount() > 1;
+    }
+
+private:
+    SharedPtr<T> ptr_;
+};
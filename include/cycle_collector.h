@@ -0,0 +1,376 @@
+#pragma once
+
+// Trial-deletion cycle collector (Bacon & Rajan, "Concurrent Cycle Collection in Reference
+// Counted Systems", synchronous variant) for `SharedPtr` and `IntrusivePtr` graphs.
+//
+// Define SMART_PTRS_CYCLE_COLLECTOR (CMake option of the same name) and let the participating
+// types expose their owned pointers:
+//
+//     struct Node : CycleCollected<Node> {          // or MakeCollected<Node>() for SharedPtr
+//         void Trace(cycle::Tracer& tracer) {
+//             tracer(next);
+//         }
+//         IntrusivePtr<Node> next;
+//     };
+//
+// A participating object whose strong count is decremented to a nonzero value becomes a
+// candidate root. `cycle::Collector::Default().CollectSlice(n)` takes up to `n` candidates,
+// finds the subgraph reachable from them whose counts are explained by internal edges alone and
+// frees it; `CollectFor(budget)` repeats slices until the time budget is spent. Each slice is
+// atomic, so pauses are bounded by the subgraph reachable from `n` roots.
+//
+// Candidates may be buffered from any thread, but a slice traverses and mutates the graph: run
+// it on a thread that owns the collected objects, or while the other threads are quiescent.
+
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+template <typename T>
+class SharedPtr;
+
+template <typename T>
+class IntrusivePtr;
+
+namespace cycle {
+
+class Collector;
+class Tracer;
+
+// Collector metadata of a participating object: of the `ControlBlock` for `SharedPtr` graphs,
+// of the object itself for `IntrusivePtr` graphs
+class Node {
+    friend class Collector;
+
+public:
+    Node() = default;
+    Node(const Node&) = delete;
+    Node& operator=(const Node&) = delete;
+
+    // Buffers the node as a possible cycle root; call before a strong decrement that leaves the
+    // count nonzero
+    void PossibleRoot();
+
+protected:
+    virtual ~Node();
+
+    // Number of strong references
+    virtual size_t StrongCount() const = 0;
+    // Reports every owned pointer to `tracer`
+    virtual void TraceObject(Tracer& tracer) = 0;
+    // Extra strong reference held while a garbage cycle is broken
+    virtual void Pin() = 0;
+    virtual void Unpin() = 0;
+
+private:
+    enum class Color : uint8_t {
+        kBlack,    // In use or free
+        kGray,     // Possible member of a cycle
+        kWhite,    // Member of a garbage cycle
+        kPurple,   // Possible root of a cycle
+        kGarbage,  // Being freed
+    };
+
+    Node* prev_ = nullptr;
+    Node* next_ = nullptr;
+    size_t trial_count_ = 0;
+    Color color_ = Color::kBlack;
+    bool buffered_ = false;
+    // Buffered and still purple, so another decrement has nothing to record and `Buffer`
+    // returns without the collector lock. Cleared once a slice takes or repaints the node.
+    std::atomic<bool> buffered_purple_{false};
+};
+
+// Passed to `Trace`: call it with every owned `SharedPtr` / `IntrusivePtr`. Pointers to
+// objects that do not participate are skipped.
+class Tracer {
+    friend class Collector;
+
+public:
+    template <typename U>
+    void operator()(SharedPtr<U>& ptr) {
+        if (clear_) {
+            ptr.Reset();
+        } else if (ptr.block_ != nullptr) {
+            Add(ptr.block_->GetCycleNode());
+        }
+    }
+
+    template <typename U>
+    void operator()(IntrusivePtr<U>& ptr) {
+        if (clear_) {
+            ptr.Reset();
+        } else if constexpr (std::is_base_of_v<Node, U>) {
+            Add(ptr.Get());
+        }
+    }
+
+private:
+    // Collects children into `children`, or drops every traced pointer
+    Tracer(std::vector<Node*>* children, bool clear) : children_(children), clear_(clear) {
+    }
+
+    void Add(Node* node) {
+        if (node != nullptr) {
+            children_->push_back(node);
+        }
+    }
+
+    std::vector<Node*>* children_;
+    bool clear_;
+};
+
+class Collector {
+    friend class Node;
+
+public:
+    static Collector& Default() {
+        static Collector collector;
+        return collector;
+    }
+
+    // Processes up to `max_roots` buffered candidates, returns the number of objects freed
+    size_t CollectSlice(size_t max_roots) {
+        std::vector<Node*> roots = TakeRoots(max_roots);
+        MarkRoots(roots);
+        for (Node* root : roots) {
+            Scan(root);
+        }
+        std::vector<Node*> garbage;
+        for (Node* root : roots) {
+            CollectWhite(root, garbage);
+        }
+        Free(garbage);
+        return garbage.size();
+    }
+
+    // Runs slices of `batch` roots until the buffer is empty or `budget` is spent
+    size_t CollectFor(std::chrono::nanoseconds budget, size_t batch = kDefaultBatch) {
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        size_t freed = 0;
+        do {
+            freed += CollectSlice(batch);
+        } while (PendingRoots() != 0 && std::chrono::steady_clock::now() < deadline);
+        return freed;
+    }
+
+    // Runs slices until every candidate is processed
+    size_t Collect() {
+        size_t freed = 0;
+        while (PendingRoots() != 0) {
+            freed += CollectSlice(kDefaultBatch);
+        }
+        return freed;
+    }
+
+    size_t PendingRoots() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pending_;
+    }
+
+private:
+    using Color = Node::Color;
+
+    static constexpr size_t kDefaultBatch = 256;
+
+    void Buffer(Node* node) {
+        if (node->buffered_purple_.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (node->color_ == Color::kGarbage) {
+            return;
+        }
+        node->color_ = Color::kPurple;
+        node->buffered_purple_.store(true, std::memory_order_release);
+        if (node->buffered_) {
+            return;
+        }
+        node->buffered_ = true;
+        node->prev_ = nullptr;
+        node->next_ = head_;
+        if (head_ != nullptr) {
+            head_->prev_ = node;
+        }
+        head_ = node;
+        ++pending_;
+    }
+
+    void Forget(Node* node) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (node->buffered_) {
+            Unlink(node);
+        }
+    }
+
+    void Unlink(Node* node) {
+        if (node->prev_ != nullptr) {
+            node->prev_->next_ = node->next_;
+        } else {
+            head_ = node->next_;
+        }
+        if (node->next_ != nullptr) {
+            node->next_->prev_ = node->prev_;
+        }
+        node->buffered_ = false;
+        node->buffered_purple_.store(false, std::memory_order_relaxed);
+        --pending_;
+    }
+
+    std::vector<Node*> TakeRoots(size_t max_roots) {
+        std::vector<Node*> roots;
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (head_ != nullptr && roots.size() < max_roots) {
+            Node* node = head_;
+            Unlink(node);
+            roots.push_back(node);
+        }
+        return roots;
+    }
+
+    void Children(Node* node, std::vector<Node*>& children) {
+        children.clear();
+        Tracer tracer(&children, false);
+        node->TraceObject(tracer);
+    }
+
+    // Keeps the purple roots, marking everything reachable from them gray with the internal
+    // references subtracted from the trial counts. Blocks whose object is already destroyed
+    // stay buffered until then, and are dropped here.
+    void MarkRoots(std::vector<Node*>& roots) {
+        size_t kept = 0;
+        for (Node* root : roots) {
+            if (root->color_ == Color::kPurple && root->StrongCount() != 0) {
+                roots[kept++] = root;
+                MarkGray(root);
+            } else if (root->color_ != Color::kGray) {
+                // Gray roots were reached from an earlier root and are scanned from there
+                root->color_ = Color::kBlack;
+            }
+        }
+        roots.resize(kept);
+    }
+
+    void MarkGray(Node* root) {
+        if (root->color_ == Color::kGray) {
+            return;
+        }
+        PaintGray(root);
+        stack_.push_back(root);
+        while (!stack_.empty()) {
+            Node* node = stack_.back();
+            stack_.pop_back();
+            Children(node, children_);
+            for (Node* child : children_) {
+                if (child->color_ != Color::kGray) {
+                    PaintGray(child);
+                    stack_.push_back(child);
+                }
+                --child->trial_count_;
+            }
+        }
+    }
+
+    // Every later color change starts from gray, so a buffered node painted here must be
+    // repainted purple by its next decrement
+    static void PaintGray(Node* node) {
+        node->color_ = Color::kGray;
+        node->trial_count_ = node->StrongCount();
+        node->buffered_purple_.store(false, std::memory_order_relaxed);
+    }
+
+    // Gray nodes still referenced from outside become black again with everything they reach,
+    // the rest turns white
+    void Scan(Node* root) {
+        stack_.push_back(root);
+        while (!stack_.empty()) {
+            Node* node = stack_.back();
+            stack_.pop_back();
+            if (node->color_ != Color::kGray) {
+                continue;
+            }
+            if (node->trial_count_ > 0) {
+                ScanBlack(node);
+                continue;
+            }
+            node->color_ = Color::kWhite;
+            Children(node, children_);
+            stack_.insert(stack_.end(), children_.begin(), children_.end());
+        }
+    }
+
+    void ScanBlack(Node* root) {
+        std::vector<Node*> stack{root};
+        std::vector<Node*> children;
+        root->color_ = Color::kBlack;
+        while (!stack.empty()) {
+            Node* node = stack.back();
+            stack.pop_back();
+            Children(node, children);
+            for (Node* child : children) {
+                ++child->trial_count_;
+                if (child->color_ != Color::kBlack) {
+                    child->color_ = Color::kBlack;
+                    stack.push_back(child);
+                }
+            }
+        }
+    }
+
+    void CollectWhite(Node* root, std::vector<Node*>& garbage) {
+        stack_.push_back(root);
+        while (!stack_.empty()) {
+            Node* node = stack_.back();
+            stack_.pop_back();
+            if (node->color_ != Color::kWhite) {
+                continue;
+            }
+            node->color_ = Color::kGarbage;
+            garbage.push_back(node);
+            Children(node, children_);
+            stack_.insert(stack_.end(), children_.begin(), children_.end());
+        }
+    }
+
+    // Pinned garbage drops its pointers first, so no object of the cycle is destroyed while
+    // another one still refers to it; unpinning then frees every object the usual way
+    static void Free(const std::vector<Node*>& garbage) {
+        for (Node* node : garbage) {
+            node->Pin();
+        }
+        Tracer clear(nullptr, true);
+        for (Node* node : garbage) {
+            node->TraceObject(clear);
+        }
+        for (Node* node : garbage) {
+            node->Unpin();
+        }
+    }
+
+    std::mutex mutex_;
+    Node* head_ = nullptr;
+    size_t pending_ = 0;
+    // Scratch space reused between slices
+    std::vector<Node*> stack_;
+    std::vector<Node*> children_;
+};
+
+inline void Node::PossibleRoot() {
+    Collector::Default().Buffer(this);
+}
+
+inline Node::~Node() {
+    if (buffered_) {
+        Collector::Default().Forget(this);
+    }
+}
+
+}  // namespace cycle
+
+#endif  // SMART_PTRS_CYCLE_COLLECTOR
@@ -0,0 +1,302 @@
+#pragma once
+
+// Opt-in instrumentation of `ControlBlock`, `RefCounted` and `UniquePtr`.
+//
+// Define SMART_PTRS_INSTRUMENTATION (CMake option of the same name) to keep, per pointee type:
+// live objects and bytes, total objects created, a histogram of the peak strong count and a
+// histogram of the object lifetime. Counters are sharded per thread, so hot paths touch a
+// cache line owned by the current thread. When <sys/sdt.h> is available, USDT probes
+// `smart_ptrs:create(type, object, bytes)` and `smart_ptrs:release(type, object, lifetime_ns)`
+// fire as well, e.g. `bpftrace -e 'usdt:./app:smart_ptrs:release { @[str(arg0)] = count(); }'`.
+//
+// Without the macro every hook below expands to nothing and the pointers compile exactly as
+// before.
+
+#ifdef SMART_PTRS_INSTRUMENTATION
+
+#include <cxxabi.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SMART_PTRS_USDT(name, a, b, c) DTRACE_PROBE3(smart_ptrs, name, a, b, c)
+#else
+#define SMART_PTRS_USDT(name, a, b, c) static_cast<void>(0)
+#endif
+
+namespace instrumentation {
+
+enum class Kind { kShared, kIntrusive, kUnique };
+
+inline constexpr size_t kShards = 8;
+inline constexpr size_t kHistogramBuckets = 48;
+
+// Bucket `i` holds values in [2^(i-1), 2^i), bucket 0 holds zero
+inline size_t HistogramBucket(uint64_t value) {
+    size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    return bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1;
+}
+
+inline uint64_t NowNs() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+struct alignas(64) Shard {
+    std::atomic<int64_t> live_objects{0};
+    std::atomic<int64_t> live_bytes{0};
+    std::atomic<uint64_t> created{0};
+    std::atomic<uint64_t> peak_refcount[kHistogramBuckets] = {};
+    std::atomic<uint64_t> lifetime_ns[kHistogramBuckets] = {};
+};
+
+// Shards are handed out to threads round-robin
+inline Shard& ShardOf(Shard* shards) {
+    static std::atomic<size_t> next_thread{0};
+    thread_local size_t index = next_thread.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shards[index];
+}
+
+struct TypeRecord {
+    TypeRecord(const std::type_info* type, Kind kind) : type(type), kind(kind) {
+    }
+
+    const std::type_info* type;
+    Kind kind;
+    Shard shards[kShards];
+    TypeRecord* next = nullptr;
+};
+
+inline std::atomic<TypeRecord*> registry_head{nullptr};
+
+inline void Register(TypeRecord* record) {
+    TypeRecord* head = registry_head.load(std::memory_order_relaxed);
+    do {
+        record->next = head;
+    } while (!registry_head.compare_exchange_weak(head, record, std::memory_order_release,
+                                                  std::memory_order_relaxed));
+}
+
+template <typename T, Kind K>
+TypeRecord& RecordFor() {
+    static TypeRecord* record = [] {
+        auto* created = new TypeRecord(&typeid(T), K);
+        Register(created);
+        return created;
+    }();
+    return *record;
+}
+
+inline std::string Demangle(const char* name) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status != 0 || demangled == nullptr) {
+        return name;
+    }
+    std::string result = demangled;
+    std::free(demangled);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Hooks
+
+inline void OnCreate(TypeRecord& record, const void* object, size_t bytes) {
+    Shard& shard = ShardOf(record.shards);
+    shard.live_objects.fetch_add(1, std::memory_order_relaxed);
+    shard.live_bytes.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+    shard.created.fetch_add(1, std::memory_order_relaxed);
+    SMART_PTRS_USDT(create, record.type->name(), object, bytes);
+    static_cast<void>(object);
+}
+
+// `created_ns == 0` means the lifetime is unknown
+inline void OnRelease(TypeRecord& record, const void* object, size_t bytes, size_t peak_refcount,
+                      uint64_t created_ns) {
+    Shard& shard = ShardOf(record.shards);
+    shard.live_objects.fetch_sub(1, std::memory_order_relaxed);
+    shard.live_bytes.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+    if (peak_refcount != 0) {
+        shard.peak_refcount[HistogramBucket(peak_refcount)].fetch_add(1,
+                                                                       std::memory_order_relaxed);
+    }
+    uint64_t lifetime = created_ns != 0 ? NowNs() - created_ns : 0;
+    if (created_ns != 0) {
+        shard.lifetime_ns[HistogramBucket(lifetime)].fetch_add(1, std::memory_order_relaxed);
+    }
+    SMART_PTRS_USDT(release, record.type->name(), object, lifetime);
+    static_cast<void>(object);
+}
+
+// Peak of a reference counter, kept next to the counter itself
+class PeakTracker {
+public:
+    PeakTracker() {
+    }
+
+    // Copies start their own history, as the counters they sit next to do
+    PeakTracker(const PeakTracker&) {
+    }
+
+    PeakTracker& operator=(const PeakTracker&) {
+        return *this;
+    }
+
+    void Update(size_t value) {
+        size_t peak = peak_.load(std::memory_order_relaxed);
+        while (value > peak &&
+               !peak_.compare_exchange_weak(peak, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    size_t Get() const {
+        return peak_.load(std::memory_order_relaxed);
+    }
+
+    void Reset(size_t value) {
+        peak_.store(value, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> peak_{1};
+};
+
+// Arrays of unknown bound have no size of their own, see `ArrayBytes`
+template <typename T>
+constexpr size_t SizeOf() {
+    if constexpr (std::is_void_v<T> || (std::is_array_v<T> && std::extent_v<T> == 0)) {
+        return 0;
+    } else {
+        return sizeof(T);
+    }
+}
+
+template <typename D, typename = void>
+struct HasLength : std::false_type {};
+
+template <typename D>
+struct HasLength<D, std::void_t<decltype(std::declval<const D&>().GetLength())>>
+    : std::true_type {};
+
+// `UniquePtr<T[]>` does not store its length. Deleters that know it (`MunmapDeleter`) report
+// their bytes, other arrays count as objects with 0 bytes.
+template <typename D>
+size_t ArrayBytes(const D& deleter) {
+    if constexpr (HasLength<D>::value) {
+        return deleter.GetLength();
+    } else {
+        static_cast<void>(deleter);
+        return 0;
+    }
+}
+
+// `UniquePtr` stores nothing extra, so only live objects and bytes are known
+template <typename T>
+void TrackUnique(const void* object, size_t bytes = SizeOf<T>()) {
+    if (object != nullptr) {
+        OnCreate(RecordFor<T, Kind::kUnique>(), object, bytes);
+    }
+}
+
+template <typename T>
+void UntrackUnique(const void* object, size_t bytes = SizeOf<T>()) {
+    if (object != nullptr) {
+        OnRelease(RecordFor<T, Kind::kUnique>(), object, bytes, 0, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reports
+
+struct TypeSnapshot {
+    std::string type;
+    Kind kind;
+    int64_t live_objects = 0;
+    int64_t live_bytes = 0;
+    uint64_t created = 0;
+    uint64_t peak_refcount[kHistogramBuckets] = {};
+    uint64_t lifetime_ns[kHistogramBuckets] = {};
+};
+
+inline std::vector<TypeSnapshot> Snapshot() {
+    std::vector<TypeSnapshot> result;
+    for (TypeRecord* record = registry_head.load(std::memory_order_acquire); record != nullptr;
+         record = record->next) {
+        TypeSnapshot snapshot;
+        snapshot.type = Demangle(record->type->name());
+        snapshot.kind = record->kind;
+        for (const Shard& shard : record->shards) {
+            snapshot.live_objects += shard.live_objects.load(std::memory_order_relaxed);
+            snapshot.live_bytes += shard.live_bytes.load(std::memory_order_relaxed);
+            snapshot.created += shard.created.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < kHistogramBuckets; ++i) {
+                snapshot.peak_refcount[i] += shard.peak_refcount[i].load(std::memory_order_relaxed);
+                snapshot.lifetime_ns[i] += shard.lifetime_ns[i].load(std::memory_order_relaxed);
+            }
+        }
+        result.push_back(std::move(snapshot));
+    }
+    return result;
+}
+
+// Upper bound of the bucket holding the `quantile`-th value, 0 for an empty histogram
+inline uint64_t HistogramPercentile(const uint64_t (&histogram)[kHistogramBuckets],
+                                    double quantile) {
+    uint64_t total = 0;
+    for (uint64_t count : histogram) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kHistogramBuckets; ++i) {
+        seen += histogram[i];
+        if (seen >= quantile * total && histogram[i] != 0) {
+            return i == 0 ? 0 : (uint64_t{1} << i) - 1;
+        }
+    }
+    return ~uint64_t{0};
+}
+
+inline const char* KindName(Kind kind) {
+    switch (kind) {
+        case Kind::kShared:
+            return "shared";
+        case Kind::kIntrusive:
+            return "intrusive";
+        case Kind::kUnique:
+            return "unique";
+    }
+    return "";
+}
+
+inline void Dump(std::FILE* out = stderr) {
+    std::fprintf(out, "%-10s %12s %14s %12s %10s %10s %14s  %s\n", "kind", "live", "live bytes",
+                 "created", "peak rc50", "peak rc99", "lifetime50 ns", "type");
+    for (const TypeSnapshot& s : Snapshot()) {
+        std::fprintf(out, "%-10s %12lld %14lld %12llu %10llu %10llu %14llu  %s\n",
+                     KindName(s.kind), static_cast<long long>(s.live_objects),
+                     static_cast<long long>(s.live_bytes),
+                     static_cast<unsigned long long>(s.created),
+                     static_cast<unsigned long long>(HistogramPercentile(s.peak_refcount, 0.5)),
+                     static_cast<unsigned long long>(HistogramPercentile(s.peak_refcount, 0.99)),
+                     static_cast<unsigned long long>(HistogramPercentile(s.lifetime_ns, 0.5)),
+                     s.type.c_str());
+    }
+}
+
+}  // namespace instrumentation
+
+#endif  // SMART_PTRS_INSTRUMENTATION
@@ -1,7 +1,12 @@
 #pragma once
 
-#include <cstddef>  // for std::nullptr_t
-#include <utility>  // for std::exchange / std::swap
+#include "cycle_collector.h"
+#include "instrumentation.h"
+
+#include <atomic>
+#include <cstddef>      // for std::nullptr_t
+#include <type_traits>  // for std::void_t
+#include <utility>      // for std::exchange / std::swap
 
 class SimpleCounter {
 public:
@@ -28,6 +33,32 @@ private:
     size_t count_ = 0;
 };
 
+// Same as `SimpleCounter`, but objects may be referenced from several threads
+class AtomicCounter {
+public:
+    AtomicCounter() {
+    }
+
+    AtomicCounter(const AtomicCounter&) {
+    }
+
+    AtomicCounter& operator=(const AtomicCounter&) {
+        return *this;
+    }
+    size_t IncRef() {
+        return count_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    size_t DecRef() {
+        return count_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    size_t RefCount() const {
+        return count_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<size_t> count_{0};
+};
+
 struct DefaultDelete {
     template <typename T>
     static void Destroy(T* object) {
@@ -40,13 +71,28 @@ class RefCounted {
 public:
     // Increase reference counter.
     void IncRef() {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        // Objects are tracked from their first reference, objects never owned are not counted
+        size_t count = counter_.IncRef();
+        if (count == 1) {
+            created_ns_ = instrumentation::NowNs();
+            peak_.Reset(1);
+            instrumentation::OnCreate(Record(), this, sizeof(Derived));
+        } else {
+            peak_.Update(count);
+        }
+#else
         counter_.IncRef();
+#endif
     }
 
     // Decrease reference counter.
     // Destroy object using Deleter when the last instance dies.
     void DecRef() {
         if (counter_.DecRef() == 0) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+            instrumentation::OnRelease(Record(), this, sizeof(Derived), peak_.Get(), created_ns_);
+#endif
             Deleter::Destroy(static_cast<Derived*>(this));
         }
     }
@@ -58,11 +104,112 @@ public:
 
 private:
     Counter counter_;
+#ifdef SMART_PTRS_INSTRUMENTATION
+    static instrumentation::TypeRecord& Record() {
+        return instrumentation::RecordFor<Derived, instrumentation::Kind::kIntrusive>();
+    }
+
+    uint64_t created_ns_ = 0;
+    instrumentation::PeakTracker peak_;
+#endif
 };
 
 template <typename Derived, typename D = DefaultDelete>
 using SimpleRefCounted = RefCounted<Derived, SimpleCounter, D>;
 
+template <typename Derived, typename D = DefaultDelete>
+using AtomicRefCounted = RefCounted<Derived, AtomicCounter, D>;
+
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+// Reference counted base whose cycles are reclaimed by `cycle::Collector`. `Derived` must have
+// `void Trace(cycle::Tracer&)` reporting its `IntrusivePtr`s and `SharedPtr`s.
+template <typename Derived, typename Deleter = DefaultDelete>
+class CycleCollected : public cycle::Node {
+public:
+    void IncRef() {
+        counter_.IncRef();
+    }
+
+    void DecRef() {
+        if (counter_.RefCount() > 1) {
+            PossibleRoot();
+        }
+        if (counter_.DecRef() == 0) {
+            Deleter::Destroy(static_cast<Derived*>(this));
+        }
+    }
+
+    size_t RefCount() const {
+        return counter_.RefCount();
+    }
+
+private:
+    size_t StrongCount() const override {
+        return RefCount();
+    }
+
+    void TraceObject(cycle::Tracer& tracer) override {
+        static_cast<Derived*>(this)->Trace(tracer);
+    }
+
+    void Pin() override {
+        IncRef();
+    }
+
+    void Unpin() override {
+        DecRef();
+    }
+
+    SimpleCounter counter_;
+};
+#endif
+
+// `IntrusivePtr<T>` counts through `T::IncRef()`/`DecRef()`/`RefCount()` when `T` has them.
+// Other types, such as opaque handles of C libraries, plug in free functions found by ADL:
+// `AddRef(T*)`, `Release(T*)` and, for `UseCount()` only, `RefCount(const T*)`. Wrap the
+// reference such libraries return from their constructors with `IntrusivePtr<T>::Adopt`:
+//
+//     inline void AddRef(cairo_surface_t* surface) { cairo_surface_reference(surface); }
+//     inline void Release(cairo_surface_t* surface) { cairo_surface_destroy(surface); }
+namespace intrusive_detail {
+
+template <typename T, typename = void>
+struct HasRefCountMembers : std::false_type {};
+
+template <typename T>
+struct HasRefCountMembers<T, std::void_t<decltype(std::declval<T&>().IncRef()),
+                                         decltype(std::declval<T&>().DecRef())>>
+    : std::true_type {};
+
+template <typename T>
+void AddRefHook(T* ptr) {
+    if constexpr (HasRefCountMembers<T>::value) {
+        ptr->IncRef();
+    } else {
+        AddRef(ptr);
+    }
+}
+
+template <typename T>
+void ReleaseHook(T* ptr) {
+    if constexpr (HasRefCountMembers<T>::value) {
+        ptr->DecRef();
+    } else {
+        Release(ptr);
+    }
+}
+
+template <typename T>
+size_t RefCountHook(const T* ptr) {
+    if constexpr (HasRefCountMembers<T>::value) {
+        return ptr->RefCount();
+    } else {
+        return RefCount(ptr);
+    }
+}
+
+}  // namespace intrusive_detail
+
 template <typename T>
 class IntrusivePtr {
     template <typename Y>
@@ -97,6 +244,13 @@ public:
         other.ptr_ = nullptr;
     }
 
+    // Takes over a reference the caller already owns, such as the one a C constructor returns
+    static IntrusivePtr Adopt(T* ptr) {
+        IntrusivePtr result;
+        result.ptr_ = ptr;
+        return result;
+    }
+
     // `operator=`-s
     IntrusivePtr& operator=(const IntrusivePtr& other) {
         if (ptr_ == other.ptr_) {
@@ -160,22 +314,26 @@ public:
         if (ptr_ == nullptr) {
             return 0;
         }
-        return ptr_->RefCount();
+        return intrusive_detail::RefCountHook(ptr_);
     }
 
     explicit operator bool() const {
-        return ptr_ != nullptr && ptr_->RefCount() != 0;
+        if constexpr (intrusive_detail::HasRefCountMembers<T>::value) {
+            return ptr_ != nullptr && ptr_->RefCount() != 0;
+        } else {
+            return ptr_ != nullptr;
+        }
     }
 
 private:
     void Decrease() {
         if (ptr_ != nullptr) {
-            ptr_->DecRef();
+            intrusive_detail::ReleaseHook(ptr_);
         }
     }
     void Increase() {
         if (ptr_ != nullptr) {
-            ptr_->IncRef();
+            intrusive_detail::AddRefHook(ptr_);
         }
     }
     T* ptr_ = nullptr;
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "shared.h"
+#include "unique.h"
+#include "unique_buffer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+// Read-only file mapping for zero-copy access to large immutable files
+
+enum class AccessPattern {
+    kNormal,
+    kSequential,  // MADV_SEQUENTIAL: aggressive readahead, pages dropped behind the reader
+    kRandom,      // MADV_RANDOM: no readahead
+};
+
+struct MappedFileOptions {
+    AccessPattern access = AccessPattern::kNormal;
+    // Fault the file in on a background thread while the caller starts reading
+    bool prefetch = false;
+};
+
+class MappedFile {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    MappedFile() = default;
+
+    static MappedFile Open(const std::string& path, const MappedFileOptions& options = {}) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        struct stat info {};
+        if (::fstat(fd, &info) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fstat " + path);
+        }
+
+        MappedFile file;
+        file.size_ = static_cast<size_t>(info.st_size);
+        if (file.size_ != 0) {
+            void* memory = ::mmap(nullptr, file.size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (memory == MAP_FAILED) {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "mmap " + path);
+            }
+            file.data_ = static_cast<const char*>(memory);
+        }
+        // The mapping holds its own reference to the file
+        ::close(fd);
+
+        file.Advise(options.access);
+        if (options.prefetch) {
+            file.StartPrefetch();
+        }
+        return file;
+    }
+
+    MappedFile(MappedFile&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)),
+          stop_prefetch_(std::move(other.stop_prefetch_)),
+          prefetcher_(std::move(other.prefetcher_)) {
+    }
+
+    MappedFile(const MappedFile&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            Close();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+            stop_prefetch_ = std::move(other.stop_prefetch_);
+            prefetcher_ = std::move(other.prefetcher_);
+        }
+        return *this;
+    }
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~MappedFile() {
+        Close();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Advise(AccessPattern access) const {
+        if (data_ == nullptr) {
+            return;
+        }
+        switch (access) {
+            case AccessPattern::kNormal:
+                ::madvise(const_cast<char*>(data_), size_, MADV_NORMAL);
+                break;
+            case AccessPattern::kSequential:
+                ::madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+                break;
+            case AccessPattern::kRandom:
+                ::madvise(const_cast<char*>(data_), size_, MADV_RANDOM);
+                break;
+        }
+    }
+
+    // Hands the mapping over to a `UniquePtr`. A running prefetch is stopped first.
+    template <typename T = char>
+    UniquePtr<const T[], MunmapDeleter> ReleaseUnique() && {
+        StopPrefetch();
+        size_t size = std::exchange(size_, 0);
+        auto* data = reinterpret_cast<const T*>(std::exchange(data_, nullptr));
+        return UniquePtr<const T[], MunmapDeleter>(data, MunmapDeleter(size));
+    }
+
+    // Moves the mapping into a shared owner. The result and every `MappedSlice` taken from it
+    // alias one control block, so any of them keeps the whole mapping (and the prefetch
+    // thread) alive.
+    template <typename T = char>
+    SharedPtr<const T> Share() && {
+        auto owner = MakeShared<MappedFile>(std::move(*this));
+        return SharedPtr<const T>(owner, reinterpret_cast<const T*>(owner->Data()));
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    const char* Data() const {
+        return data_;
+    }
+
+    // Size in bytes
+    size_t Size() const {
+        return size_;
+    }
+
+    template <typename T>
+    size_t Count() const {
+        return size_ / sizeof(T);
+    }
+
+private:
+    void StartPrefetch() {
+        if (data_ == nullptr) {
+            return;
+        }
+        stop_prefetch_ = UniquePtr<std::atomic<bool>>(new std::atomic<bool>(false));
+        // The thread must not touch `this`: the file may be moved while it runs
+        prefetcher_ = std::thread([data = data_, size = size_, stop = stop_prefetch_.Get()] {
+            const size_t page = buffer_detail::PageSize();
+            for (size_t offset = 0; offset < size; offset += page) {
+                if (stop->load(std::memory_order_relaxed)) {
+                    return;
+                }
+                static_cast<void>(*static_cast<const volatile char*>(data + offset));
+            }
+        });
+    }
+
+    void StopPrefetch() {
+        if (prefetcher_.joinable()) {
+            stop_prefetch_->store(true, std::memory_order_relaxed);
+            prefetcher_.join();
+        }
+        stop_prefetch_.Reset();
+    }
+
+    void Close() {
+        StopPrefetch();
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char*>(data_), size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    UniquePtr<std::atomic<bool>> stop_prefetch_;
+    std::thread prefetcher_;
+};
+
+// View of the mapping `offset` bytes after `base`, sharing ownership with `base`.
+// Not checked: `offset + sizeof(T)` must not pass the end of the mapping, and
+// `base.Get() + offset` must be aligned for `T`.
+template <typename T, typename U>
+SharedPtr<const T> MappedSlice(const SharedPtr<const U>& base, size_t offset) {
+    const char* bytes = reinterpret_cast<const char*>(base.Get());
+    return SharedPtr<const T>(base, reinterpret_cast<const T*>(bytes + offset));
+}
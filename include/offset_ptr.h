@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>  // std::nullptr_t
+#include <cstdint>
+#include <type_traits>
+
+// Pointer stored as the distance from its own address to the pointee. An object graph linked
+// with `OffsetPtr` stays valid when the memory holding it is mapped at another address
+// (shared memory, an mmap'd snapshot file), as long as pointer and pointee move together.
+template <typename T>
+class OffsetPtr {
+    template <typename Y>
+    friend class OffsetPtr;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    OffsetPtr() {
+    }
+
+    OffsetPtr(std::nullptr_t) {
+    }
+
+    OffsetPtr(T* ptr) {
+        Set(ptr);
+    }
+
+    // The offset depends on where the pointer lives, so copies are always recomputed
+    OffsetPtr(const OffsetPtr& other) {
+        Set(other.Get());
+    }
+
+    template <typename Y>
+    OffsetPtr(const OffsetPtr<Y>& other) {
+        Set(other.Get());
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    OffsetPtr& operator=(const OffsetPtr& other) {
+        Set(other.Get());
+        return *this;
+    }
+
+    template <typename Y>
+    OffsetPtr& operator=(const OffsetPtr<Y>& other) {
+        Set(other.Get());
+        return *this;
+    }
+
+    OffsetPtr& operator=(T* ptr) {
+        Set(ptr);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset(T* ptr = nullptr) {
+        Set(ptr);
+    }
+
+    void Swap(OffsetPtr& other) {
+        T* mine = Get();
+        Set(other.Get());
+        other.Set(mine);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        if (offset_ == kNull) {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(this) + offset_);
+    }
+
+    std::add_lvalue_reference_t<T> operator*() const {
+        return *Get();
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    explicit operator bool() const {
+        return offset_ != kNull;
+    }
+
+private:
+    // A pointee can never start one byte into the pointer itself
+    static constexpr uintptr_t kNull = 1;
+
+    void Set(T* ptr) {
+        if (ptr == nullptr) {
+            offset_ = kNull;
+        } else {
+            offset_ = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(this);
+        }
+    }
+
+    uintptr_t offset_ = kNull;
+};
+
+template <typename T, typename U>
+inline bool operator==(const OffsetPtr<T>& left, const OffsetPtr<U>& right) {
+    return left.Get() == right.Get();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const OffsetPtr<T>& left, const OffsetPtr<U>& right) {
+    return !(left == right);
+}
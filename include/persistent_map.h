@@ -0,0 +1,328 @@
+#pragma once
+
+#include "intrusive.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Immutable hash map with structural sharing: a hash array mapped trie (HAMT) with 32-way
+// `IntrusivePtr` linked nodes. Each node keeps its entries and its children in two compact
+// arrays indexed by bitmaps (the CHAMP layout), so updates copy the O(log32 n) nodes on the path
+// and share the rest. Keys whose hashes agree in every bit end up in a collision node.
+//
+// `Transient()` returns a builder that mutates nodes in place while it is their only owner
+// (`UseCount() == 1`) and copies them otherwise.
+
+namespace persistent_detail {
+
+// Hash bits consumed per level, and the hash width after which keys collide
+inline constexpr size_t kMapBits = 5;
+inline constexpr size_t kMapMask = (size_t{1} << kMapBits) - 1;
+inline constexpr size_t kHashBits = sizeof(size_t) * 8;
+
+template <typename K, typename V>
+struct MapNode : AtomicRefCounted<MapNode<K, V>> {
+    size_t Fragment(size_t hash, size_t shift) const {
+        return (hash >> shift) & kMapMask;
+    }
+
+    // Position of the entry or child for `bit` within its array
+    static size_t Index(uint32_t bitmap, uint32_t bit) {
+        return __builtin_popcount(bitmap & (bit - 1));
+    }
+
+    bool Empty() const {
+        return entries.empty() && children.empty();
+    }
+
+    // Both bitmaps are zero in collision nodes, which hold entries in insertion order
+    uint32_t entry_map = 0;
+    uint32_t child_map = 0;
+    std::vector<std::pair<K, V>> entries;
+    std::vector<IntrusivePtr<MapNode>> children;
+};
+
+}  // namespace persistent_detail
+
+template <typename K, typename V, typename Hash, typename Equal>
+class TransientMap;
+
+template <typename K, typename V, typename Hash = std::hash<K>, typename Equal = std::equal_to<K>>
+class PersistentMap {
+    friend class TransientMap<K, V, Hash, Equal>;
+
+    using Node = persistent_detail::MapNode<K, V>;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    PersistentMap() {
+    }
+
+    PersistentMap(const PersistentMap& other) = default;
+
+    PersistentMap(PersistentMap&& other)
+        : root_(std::move(other.root_)), size_(std::exchange(other.size_, 0)) {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    PersistentMap& operator=(const PersistentMap& other) = default;
+
+    PersistentMap& operator=(PersistentMap&& other) {
+        PersistentMap(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    void Swap(PersistentMap& other) {
+        root_.Swap(other.root_);
+        std::swap(size_, other.size_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Updates, each returning a new version
+
+    template <typename U>
+    PersistentMap Set(const K& key, U&& value) const {
+        TransientMap<K, V, Hash, Equal> builder = Transient();
+        builder.Set(key, std::forward<U>(value));
+        return std::move(builder).Persistent();
+    }
+
+    // Shares every node with this version when `key` is absent
+    PersistentMap Erase(const K& key) const {
+        TransientMap<K, V, Hash, Equal> builder = Transient();
+        builder.Erase(key);
+        return std::move(builder).Persistent();
+    }
+
+    // Builder sharing every node with this version
+    TransientMap<K, V, Hash, Equal> Transient() const& {
+        return TransientMap<K, V, Hash, Equal>(*this);
+    }
+
+    // Builder taking over the nodes, which are then updated in place where unshared
+    TransientMap<K, V, Hash, Equal> Transient() && {
+        return TransientMap<K, V, Hash, Equal>(std::move(*this));
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Null if `key` is absent
+    const V* Find(const K& key) const {
+        size_t hash = Hash{}(key);
+        const Node* node = root_.Get();
+        for (size_t shift = 0; node != nullptr; shift += persistent_detail::kMapBits) {
+            if (shift >= persistent_detail::kHashBits) {
+                for (const auto& entry : node->entries) {
+                    if (Equal{}(entry.first, key)) {
+                        return &entry.second;
+                    }
+                }
+                return nullptr;
+            }
+            uint32_t bit = uint32_t{1} << node->Fragment(hash, shift);
+            if (node->entry_map & bit) {
+                const auto& entry = node->entries[Node::Index(node->entry_map, bit)];
+                return Equal{}(entry.first, key) ? &entry.second : nullptr;
+            }
+            if (!(node->child_map & bit)) {
+                return nullptr;
+            }
+            node = node->children[Node::Index(node->child_map, bit)].Get();
+        }
+        return nullptr;
+    }
+
+    bool Contains(const K& key) const {
+        return Find(key) != nullptr;
+    }
+
+    // Calls `visitor(key, value)` for every entry, in no particular order
+    template <typename Visitor>
+    void ForEach(Visitor&& visitor) const {
+        if (root_.Get() != nullptr) {
+            Visit(*root_, visitor);
+        }
+    }
+
+private:
+    template <typename Visitor>
+    static void Visit(const Node& node, Visitor& visitor) {
+        for (const auto& entry : node.entries) {
+            visitor(entry.first, entry.second);
+        }
+        for (const auto& child : node.children) {
+            Visit(*child, visitor);
+        }
+    }
+
+    IntrusivePtr<Node> root_;
+    size_t size_ = 0;
+};
+
+// Batch builder for `PersistentMap`: nodes it owns alone are updated in place, shared ones are
+// copied first. `Persistent()` turns it back into an immutable map.
+template <typename K, typename V, typename Hash = std::hash<K>, typename Equal = std::equal_to<K>>
+class TransientMap {
+    friend class PersistentMap<K, V, Hash, Equal>;
+
+    using Node = persistent_detail::MapNode<K, V>;
+    using Entry = std::pair<K, V>;
+
+    static constexpr size_t kBits = persistent_detail::kMapBits;
+    static constexpr size_t kHashBits = persistent_detail::kHashBits;
+
+public:
+    TransientMap() {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // Inserts or overwrites
+    template <typename U>
+    void Set(const K& key, U&& value) {
+        if (Insert(map_.root_, Entry(key, std::forward<U>(value)), Hash{}(key), 0)) {
+            ++map_.size_;
+        }
+    }
+
+    // Returns whether `key` was present
+    bool Erase(const K& key) {
+        if (!map_.Contains(key)) {
+            return false;
+        }
+        Remove(map_.root_, key, Hash{}(key), 0);
+        if (map_.root_->Empty()) {
+            map_.root_.Reset();
+        }
+        --map_.size_;
+        return true;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return map_.Size();
+    }
+
+    const V* Find(const K& key) const {
+        return map_.Find(key);
+    }
+
+    PersistentMap<K, V, Hash, Equal> Persistent() && {
+        return std::move(map_);
+    }
+
+private:
+    explicit TransientMap(PersistentMap<K, V, Hash, Equal> map) : map_(std::move(map)) {
+    }
+
+    // Makes `slot` the only owner of its node, copying the node if it is shared
+    static Node* Unique(IntrusivePtr<Node>& slot) {
+        if (slot.Get() == nullptr) {
+            slot.Reset(new Node());
+        } else if (slot.UseCount() != 1) {
+            slot.Reset(new Node(*slot));
+        }
+        return slot.Get();
+    }
+
+    // Returns whether the entry is new
+    static bool Insert(IntrusivePtr<Node>& slot, Entry&& entry, size_t hash, size_t shift) {
+        Node* node = Unique(slot);
+        if (shift >= kHashBits) {
+            for (auto& existing : node->entries) {
+                if (Equal{}(existing.first, entry.first)) {
+                    existing.second = std::move(entry.second);
+                    return false;
+                }
+            }
+            node->entries.push_back(std::move(entry));
+            return true;
+        }
+
+        uint32_t bit = uint32_t{1} << node->Fragment(hash, shift);
+        if (node->child_map & bit) {
+            return Insert(node->children[Node::Index(node->child_map, bit)], std::move(entry), hash,
+                          shift + kBits);
+        }
+        if (!(node->entry_map & bit)) {
+            node->entries.insert(node->entries.begin() + Node::Index(node->entry_map, bit),
+                                 std::move(entry));
+            node->entry_map |= bit;
+            return true;
+        }
+
+        size_t index = Node::Index(node->entry_map, bit);
+        Entry& existing = node->entries[index];
+        if (Equal{}(existing.first, entry.first)) {
+            existing.second = std::move(entry.second);
+            return false;
+        }
+        // Two keys share the fragment: both move one level down
+        IntrusivePtr<Node> child;
+        size_t existing_hash = Hash{}(existing.first);
+        Insert(child, std::move(existing), existing_hash, shift + kBits);
+        Insert(child, std::move(entry), hash, shift + kBits);
+        node->entries.erase(node->entries.begin() + index);
+        node->entry_map &= ~bit;
+        node->children.insert(node->children.begin() + Node::Index(node->child_map, bit),
+                              std::move(child));
+        node->child_map |= bit;
+        return true;
+    }
+
+    // `key` is known to be present. A child left with a single entry and no children is inlined
+    // into its parent, so equal maps have equal shapes.
+    static void Remove(IntrusivePtr<Node>& slot, const K& key, size_t hash, size_t shift) {
+        Node* node = Unique(slot);
+        if (shift >= kHashBits) {
+            for (auto it = node->entries.begin(); it != node->entries.end(); ++it) {
+                if (Equal{}(it->first, key)) {
+                    node->entries.erase(it);
+                    return;
+                }
+            }
+            return;
+        }
+
+        uint32_t bit = uint32_t{1} << node->Fragment(hash, shift);
+        if (node->entry_map & bit) {
+            node->entries.erase(node->entries.begin() + Node::Index(node->entry_map, bit));
+            node->entry_map &= ~bit;
+            return;
+        }
+
+        size_t child_index = Node::Index(node->child_map, bit);
+        IntrusivePtr<Node>& child = node->children[child_index];
+        Remove(child, key, hash, shift + kBits);
+        if (!child->children.empty() || child->entries.size() != 1) {
+            return;
+        }
+        Entry last = std::move(child->entries.front());
+        node->children.erase(node->children.begin() + child_index);
+        node->child_map &= ~bit;
+        node->entries.insert(node->entries.begin() + Node::Index(node->entry_map, bit),
+                             std::move(last));
+        node->entry_map |= bit;
+    }
+
+    PersistentMap<K, V, Hash, Equal> map_;
+};
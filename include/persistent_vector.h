@@ -0,0 +1,457 @@
+#pragma once
+
+#include "intrusive.h"
+
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+// Immutable vector with structural sharing: a 32-way bit-partitioned trie of `IntrusivePtr`
+// linked nodes plus a tail leaf. Updates copy the O(log32 n) nodes on the path and share the
+// rest, so snapshots are O(1) copies and may be read from several threads.
+//
+// `Transient()` returns a builder that mutates nodes in place while it is their only owner
+// (`UseCount() == 1`) and copies them otherwise.
+
+namespace persistent_detail {
+
+inline constexpr size_t kBits = 5;
+inline constexpr size_t kWidth = size_t{1} << kBits;
+inline constexpr size_t kMask = kWidth - 1;
+
+// Nodes are deleted through the base, so the destructor is virtual
+struct VectorNode : AtomicRefCounted<VectorNode> {
+    virtual ~VectorNode() = default;
+};
+
+struct VectorBranch : VectorNode {
+    IntrusivePtr<VectorNode> children[kWidth];
+};
+
+template <typename T>
+class VectorLeaf : public VectorNode {
+public:
+    VectorLeaf() = default;
+
+    VectorLeaf(const VectorLeaf& other) {
+        for (; size_ < other.size_; ++size_) {
+            ::new (Slot(size_)) T(other[size_]);
+        }
+    }
+
+    VectorLeaf& operator=(const VectorLeaf&) = delete;
+
+    ~VectorLeaf() override {
+        std::destroy(Slot(0), Slot(size_));
+    }
+
+    const T& operator[](size_t index) const {
+        return *std::launder(reinterpret_cast<const T*>(storage_) + index);
+    }
+
+    T& operator[](size_t index) {
+        return *Slot(index);
+    }
+
+    template <typename U>
+    void Push(U&& value) {
+        ::new (Slot(size_)) T(std::forward<U>(value));
+        ++size_;
+    }
+
+    void Pop() {
+        --size_;
+        std::destroy_at(Slot(size_));
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    T* Slot(size_t index) {
+        return std::launder(reinterpret_cast<T*>(storage_) + index);
+    }
+
+    alignas(T) unsigned char storage_[kWidth * sizeof(T)];
+    size_t size_ = 0;
+};
+
+}  // namespace persistent_detail
+
+template <typename T>
+class TransientVector;
+
+template <typename T>
+class PersistentVector {
+    friend class TransientVector<T>;
+
+    using Node = persistent_detail::VectorNode;
+    using Branch = persistent_detail::VectorBranch;
+    using Leaf = persistent_detail::VectorLeaf<T>;
+
+public:
+    class ConstIterator;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    PersistentVector() {
+    }
+
+    PersistentVector(const PersistentVector& other) = default;
+
+    PersistentVector(PersistentVector&& other)
+        : root_(std::move(other.root_)),
+          tail_(std::move(other.tail_)),
+          size_(std::exchange(other.size_, 0)),
+          shift_(std::exchange(other.shift_, persistent_detail::kBits)) {
+    }
+
+    PersistentVector(std::initializer_list<T> values) {
+        TransientVector<T> builder;
+        for (const T& value : values) {
+            builder.PushBack(value);
+        }
+        *this = std::move(builder).Persistent();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    PersistentVector& operator=(const PersistentVector& other) = default;
+
+    PersistentVector& operator=(PersistentVector&& other) {
+        PersistentVector(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    void Swap(PersistentVector& other) {
+        root_.Swap(other.root_);
+        tail_.Swap(other.tail_);
+        std::swap(size_, other.size_);
+        std::swap(shift_, other.shift_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Updates, each returning a new version
+
+    template <typename U>
+    PersistentVector PushBack(U&& value) const {
+        TransientVector<T> builder = Transient();
+        builder.PushBack(std::forward<U>(value));
+        return std::move(builder).Persistent();
+    }
+
+    template <typename U>
+    PersistentVector Set(size_t index, U&& value) const {
+        TransientVector<T> builder = Transient();
+        builder.Set(index, std::forward<U>(value));
+        return std::move(builder).Persistent();
+    }
+
+    PersistentVector PopBack() const {
+        TransientVector<T> builder = Transient();
+        builder.PopBack();
+        return std::move(builder).Persistent();
+    }
+
+    // Builder sharing every node with this version
+    TransientVector<T> Transient() const& {
+        return TransientVector<T>(*this);
+    }
+
+    // Builder taking over the nodes, which are then updated in place where unshared
+    TransientVector<T> Transient() && {
+        return TransientVector<T>(std::move(*this));
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    const T& operator[](size_t index) const {
+        return (*LeafFor(index))[index & persistent_detail::kMask];
+    }
+
+    const T& At(size_t index) const {
+        if (index >= size_) {
+            throw std::out_of_range("PersistentVector::At");
+        }
+        return (*this)[index];
+    }
+
+    const T& Back() const {
+        return (*this)[size_ - 1];
+    }
+
+    ConstIterator begin() const {
+        return ConstIterator(this, 0);
+    }
+
+    ConstIterator end() const {
+        return ConstIterator(this, size_);
+    }
+
+private:
+    size_t TailOffset() const {
+        return size_ < persistent_detail::kWidth ? 0 : (size_ - 1) & ~persistent_detail::kMask;
+    }
+
+    // Leaf holding `index`
+    const Leaf* LeafFor(size_t index) const {
+        if (index >= TailOffset()) {
+            return static_cast<const Leaf*>(tail_.Get());
+        }
+        const Node* node = root_.Get();
+        for (size_t level = shift_; level > 0; level -= persistent_detail::kBits) {
+            node = static_cast<const Branch*>(node)
+                       ->children[(index >> level) & persistent_detail::kMask]
+                       .Get();
+        }
+        return static_cast<const Leaf*>(node);
+    }
+
+    IntrusivePtr<Node> root_;
+    IntrusivePtr<Node> tail_;
+    size_t size_ = 0;
+    // Bits of the index consumed above the leaves
+    size_t shift_ = persistent_detail::kBits;
+};
+
+// Walks leaf by leaf, so a full scan costs one trie descent per 32 elements
+template <typename T>
+class PersistentVector<T>::ConstIterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    ConstIterator() = default;
+
+    const T& operator*() const {
+        return (*leaf_)[index_ & persistent_detail::kMask];
+    }
+
+    const T* operator->() const {
+        return &**this;
+    }
+
+    ConstIterator& operator++() {
+        ++index_;
+        if ((index_ & persistent_detail::kMask) == 0) {
+            leaf_ = index_ < vector_->size_ ? vector_->LeafFor(index_) : nullptr;
+        }
+        return *this;
+    }
+
+    ConstIterator operator++(int) {
+        ConstIterator copy = *this;
+        ++*this;
+        return copy;
+    }
+
+    bool operator==(const ConstIterator& other) const {
+        return index_ == other.index_;
+    }
+
+    bool operator!=(const ConstIterator& other) const {
+        return index_ != other.index_;
+    }
+
+private:
+    friend class PersistentVector;
+
+    ConstIterator(const PersistentVector* vector, size_t index)
+        : vector_(vector),
+          leaf_(index < vector->size_ ? vector->LeafFor(index) : nullptr),
+          index_(index) {
+    }
+
+    const PersistentVector* vector_ = nullptr;
+    const Leaf* leaf_ = nullptr;
+    size_t index_ = 0;
+};
+
+// Batch builder for `PersistentVector`: nodes it owns alone are updated in place, shared ones
+// are copied first. `Persistent()` turns it back into an immutable vector.
+template <typename T>
+class TransientVector {
+    friend class PersistentVector<T>;
+
+    using Node = persistent_detail::VectorNode;
+    using Branch = persistent_detail::VectorBranch;
+    using Leaf = persistent_detail::VectorLeaf<T>;
+
+    static constexpr size_t kBits = persistent_detail::kBits;
+    static constexpr size_t kWidth = persistent_detail::kWidth;
+    static constexpr size_t kMask = persistent_detail::kMask;
+
+public:
+    TransientVector() {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    template <typename U>
+    void PushBack(U&& value) {
+        if (vector_.size_ - vector_.TailOffset() == kWidth) {
+            PushTail();
+            vector_.tail_ = nullptr;
+        }
+        UniqueLeaf(vector_.tail_)->Push(std::forward<U>(value));
+        ++vector_.size_;
+    }
+
+    template <typename U>
+    void Set(size_t index, U&& value) {
+        if (index >= vector_.size_) {
+            throw std::out_of_range("TransientVector::Set");
+        }
+        if (index >= vector_.TailOffset()) {
+            (*UniqueLeaf(vector_.tail_))[index & kMask] = std::forward<U>(value);
+            return;
+        }
+        IntrusivePtr<Node>* slot = &vector_.root_;
+        for (size_t level = vector_.shift_; level > 0; level -= kBits) {
+            slot = &UniqueBranch(*slot)->children[(index >> level) & kMask];
+        }
+        (*UniqueLeaf(*slot))[index & kMask] = std::forward<U>(value);
+    }
+
+    void PopBack() {
+        if (vector_.size_ == 0) {
+            throw std::out_of_range("TransientVector::PopBack");
+        }
+        if (vector_.size_ == 1) {
+            vector_ = PersistentVector<T>();
+            return;
+        }
+        if (vector_.size_ - vector_.TailOffset() > 1) {
+            UniqueLeaf(vector_.tail_)->Pop();
+            --vector_.size_;
+            return;
+        }
+        // The last leaf of the trie becomes the tail
+        IntrusivePtr<Node> new_tail(const_cast<Leaf*>(vector_.LeafFor(vector_.size_ - 2)));
+        PopTail(vector_.root_, vector_.shift_);
+        if (vector_.shift_ > kBits && Children(vector_.root_)[1].Get() == nullptr) {
+            IntrusivePtr<Node> child = Children(vector_.root_)[0];
+            vector_.root_ = std::move(child);
+            vector_.shift_ -= kBits;
+        }
+        vector_.tail_ = std::move(new_tail);
+        --vector_.size_;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return vector_.Size();
+    }
+
+    const T& operator[](size_t index) const {
+        return vector_[index];
+    }
+
+    PersistentVector<T> Persistent() && {
+        return std::move(vector_);
+    }
+
+private:
+    explicit TransientVector(PersistentVector<T> vector) : vector_(std::move(vector)) {
+    }
+
+    static IntrusivePtr<Node>* Children(const IntrusivePtr<Node>& branch) {
+        return static_cast<Branch*>(branch.Get())->children;
+    }
+
+    // Makes `slot` the only owner of its node, copying the node if it is shared
+    static Branch* UniqueBranch(IntrusivePtr<Node>& slot) {
+        if (slot.Get() == nullptr) {
+            slot.Reset(new Branch());
+        } else if (slot.UseCount() != 1) {
+            slot.Reset(new Branch(*static_cast<Branch*>(slot.Get())));
+        }
+        return static_cast<Branch*>(slot.Get());
+    }
+
+    static Leaf* UniqueLeaf(IntrusivePtr<Node>& slot) {
+        if (slot.Get() == nullptr) {
+            slot.Reset(new Leaf());
+        } else if (slot.UseCount() != 1) {
+            slot.Reset(new Leaf(*static_cast<Leaf*>(slot.Get())));
+        }
+        return static_cast<Leaf*>(slot.Get());
+    }
+
+    // Chain of single-child branches from `level` down to `leaf`
+    static IntrusivePtr<Node> NewPath(size_t level, IntrusivePtr<Node> leaf) {
+        if (level == 0) {
+            return leaf;
+        }
+        IntrusivePtr<Node> branch(new Branch());
+        Children(branch)[0] = NewPath(level - kBits, std::move(leaf));
+        return branch;
+    }
+
+    // Moves the full tail into the trie
+    void PushTail() {
+        size_t size = vector_.size_;
+        size_t& shift = vector_.shift_;
+        if ((size >> kBits) > (size_t{1} << shift)) {
+            IntrusivePtr<Node> root(new Branch());
+            Children(root)[0] = std::move(vector_.root_);
+            Children(root)[1] = NewPath(shift, std::move(vector_.tail_));
+            vector_.root_ = std::move(root);
+            shift += kBits;
+            return;
+        }
+        IntrusivePtr<Node>* slot = &vector_.root_;
+        for (size_t level = shift;; level -= kBits) {
+            IntrusivePtr<Node>& child = UniqueBranch(*slot)->children[((size - 1) >> level) & kMask];
+            if (level == kBits) {
+                child = std::move(vector_.tail_);
+                return;
+            }
+            if (child.Get() == nullptr) {
+                child = NewPath(level - kBits, std::move(vector_.tail_));
+                return;
+            }
+            slot = &child;
+        }
+    }
+
+    // Drops the last leaf of the subtree in `slot`, and the subtree itself once it is empty
+    void PopTail(IntrusivePtr<Node>& slot, size_t level) {
+        size_t index = ((vector_.size_ - 2) >> level) & kMask;
+        if (level > kBits) {
+            IntrusivePtr<Node>& child = UniqueBranch(slot)->children[index];
+            PopTail(child, level - kBits);
+            if (child.Get() != nullptr || index != 0) {
+                return;
+            }
+        } else if (index != 0) {
+            UniqueBranch(slot)->children[index] = nullptr;
+            return;
+        }
+        slot = nullptr;
+    }
+
+    PersistentVector<T> vector_;
+};
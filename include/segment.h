@@ -0,0 +1,548 @@
+#pragma once
+
+#include "offset_ptr.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>  // std::nullptr_t
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Position-independent object graphs in a memory segment shared between processes or
+// persisted as a snapshot file. Everything stored in a segment must link to other objects
+// through `OffsetPtr`/`OffsetSharedPtr` only: raw pointers and vtables are per-process.
+
+template <typename T>
+class OffsetSharedPtr;
+
+template <typename T>
+class SegmentControlBlock;
+
+// Header at the start of a segment, followed by the allocation arena. Blocks come in
+// power-of-two size classes, freed blocks are kept on per-class free lists.
+class Segment {
+    static constexpr uint64_t kMagic = 0x53505452534547ull;  // "SPTRSEG"
+    static constexpr size_t kMinBlock = 16;
+    static constexpr size_t kSizeClasses = 48;
+
+public:
+    static constexpr size_t kMaxAlignment = 64;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    // Formats `size` bytes at `memory` (aligned to `kMaxAlignment`) as an empty segment
+    static Segment* Create(void* memory, size_t size) {
+        if (reinterpret_cast<uintptr_t>(memory) % kMaxAlignment != 0) {
+            throw std::invalid_argument("segment memory is not aligned");
+        }
+        if (size < ArenaBegin()) {
+            throw std::invalid_argument("segment is too small");
+        }
+        return ::new (memory) Segment(size);
+    }
+
+    // Uses a segment formatted earlier, possibly by another process or at another address.
+    // `size` is the number of bytes available at `memory`.
+    static Segment* Attach(void* memory, size_t size) {
+        if (size < sizeof(Segment)) {
+            throw std::invalid_argument("memory is too small to hold a segment");
+        }
+        auto* segment = std::launder(static_cast<Segment*>(memory));
+        if (segment->magic_ != kMagic) {
+            throw std::invalid_argument("memory does not hold a segment");
+        }
+        if (segment->size_ > size || segment->used_.load(std::memory_order_relaxed) > size) {
+            throw std::invalid_argument("segment is larger than its memory");
+        }
+        return segment;
+    }
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Allocation
+
+    void* Allocate(size_t bytes, size_t alignment) {
+        size_t size_class = SizeClass(bytes, alignment);
+        size_t block = size_t{1} << size_class;
+
+        Lock();
+        uint64_t offset = free_lists_[size_class];
+        if (offset != 0) {
+            free_lists_[size_class] = *reinterpret_cast<uint64_t*>(Base() + offset);
+        } else {
+            size_t step = block < kMaxAlignment ? block : kMaxAlignment;
+            offset = RoundUp(used_.load(std::memory_order_relaxed), step);
+            if (offset + block > size_) {
+                Unlock();
+                throw std::bad_alloc{};
+            }
+            used_.store(offset + block, std::memory_order_relaxed);
+        }
+        Unlock();
+        return Base() + offset;
+    }
+
+    // `bytes` and `alignment` must be the values passed to `Allocate`
+    void Deallocate(void* ptr, size_t bytes, size_t alignment) {
+        size_t size_class = SizeClass(bytes, alignment);
+        uint64_t offset = static_cast<char*>(ptr) - Base();
+
+        Lock();
+        *static_cast<uint64_t*>(ptr) = free_lists_[size_class];
+        free_lists_[size_class] = offset;
+        Unlock();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Root object
+    // The root keeps the graph alive across processes and snapshots. It has one type `T` for
+    // the lifetime of the segment, and every call below must use that type. The root slot is
+    // guarded by the segment lock, so processes may replace and read it concurrently.
+
+    template <typename T>
+    void SetRoot(const OffsetSharedPtr<T>& root);
+
+    template <typename T>
+    OffsetSharedPtr<T> GetRoot();
+
+    template <typename T>
+    void ResetRoot();
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Bytes handed out by the bump allocator, including the header
+    size_t Used() const {
+        return used_.load(std::memory_order_relaxed);
+    }
+
+    bool Contains(const void* ptr) const {
+        auto address = reinterpret_cast<uintptr_t>(ptr);
+        auto base = reinterpret_cast<uintptr_t>(this);
+        return address >= base && address < base + size_;
+    }
+
+private:
+    static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                      std::atomic<uint32_t>::is_always_lock_free,
+                  "segment atomics must be address-free to work across processes");
+
+    explicit Segment(size_t size) : size_(size) {
+        used_.store(ArenaBegin(), std::memory_order_relaxed);
+    }
+
+    static size_t RoundUp(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    static constexpr size_t ArenaBegin() {
+        return (sizeof(Segment) + kMaxAlignment - 1) / kMaxAlignment * kMaxAlignment;
+    }
+
+    static size_t SizeClass(size_t bytes, size_t alignment) {
+        if (alignment > kMaxAlignment || (alignment & (alignment - 1)) != 0) {
+            throw std::invalid_argument("unsupported alignment");
+        }
+        size_t need = bytes < alignment ? alignment : bytes;
+        // Checked first: the shift below must stay under 64
+        if (need > (size_t{1} << (kSizeClasses - 1))) {
+            throw std::bad_alloc{};
+        }
+        size_t size_class = 0;
+        while ((size_t{1} << size_class) < need || (size_t{1} << size_class) < kMinBlock) {
+            ++size_class;
+        }
+        return size_class;
+    }
+
+    char* Base() {
+        return reinterpret_cast<char*>(this);
+    }
+
+    // Spin lock shared by every process mapping the segment
+    void Lock() {
+        while (lock_.exchange(1, std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    void Unlock() {
+        lock_.store(0, std::memory_order_release);
+    }
+
+    uint64_t magic_ = kMagic;
+    uint64_t size_;
+    std::atomic<uint64_t> used_{0};
+    std::atomic<uint32_t> lock_{0};
+    uint64_t free_lists_[kSizeClasses] = {};
+    OffsetPtr<void> root_;
+};
+
+// Control block allocated in the segment next to the object
+template <typename T>
+class SegmentControlBlock {
+public:
+    template <typename... Args>
+    SegmentControlBlock(Segment& segment, Args&&... args)
+        : segment_offset_(reinterpret_cast<char*>(this) - reinterpret_cast<char*>(&segment)),
+          value_(std::forward<Args>(args)...) {
+    }
+
+    void IncStrong() {
+        strong_counter_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Returns true when the last strong reference is gone
+    bool DecStrong() {
+        return strong_counter_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    size_t GetStrongCounter() const {
+        return strong_counter_.load(std::memory_order_relaxed);
+    }
+
+    T* GetPointer() {
+        return &value_;
+    }
+
+    Segment& GetSegment() {
+        return *reinterpret_cast<Segment*>(reinterpret_cast<char*>(this) - segment_offset_);
+    }
+
+private:
+    std::atomic<uint64_t> strong_counter_{1};
+    uint64_t segment_offset_;
+    T value_;
+};
+
+// `SharedPtr` for objects living in a `Segment`. The pointer itself is position independent,
+// so it can be stored inside other segment objects. There is no conversion to a pointer to a
+// base: the block is destroyed and freed as a `SegmentControlBlock<T>`, and a virtual
+// destructor is not available across processes.
+template <typename T>
+class OffsetSharedPtr {
+    friend class Segment;
+
+    template <typename Y, typename... Args>
+    friend OffsetSharedPtr<Y> MakeOffsetShared(Segment& segment, Args&&... args);
+
+    using Block = SegmentControlBlock<T>;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    OffsetSharedPtr() {
+    }
+
+    OffsetSharedPtr(std::nullptr_t) {
+    }
+
+    OffsetSharedPtr(const OffsetSharedPtr& other) : block_(other.block_) {
+        Increase();
+    }
+
+    OffsetSharedPtr(OffsetSharedPtr&& other) : block_(other.block_) {
+        other.block_ = nullptr;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    OffsetSharedPtr& operator=(const OffsetSharedPtr& other) {
+        if (block_ == other.block_) {
+            return *this;
+        }
+        Decrease();
+        block_ = other.block_;
+        Increase();
+        return *this;
+    }
+
+    OffsetSharedPtr& operator=(OffsetSharedPtr&& other) {
+        if (this == &other) {
+            return *this;
+        }
+        Decrease();
+        block_ = other.block_;
+        other.block_ = nullptr;
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~OffsetSharedPtr() {
+        Decrease();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        Decrease();
+        block_ = nullptr;
+    }
+
+    void Swap(OffsetSharedPtr& other) {
+        block_.Swap(other.block_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        Block* block = block_.Get();
+        return block == nullptr ? nullptr : block->GetPointer();
+    }
+
+    T& operator*() const {
+        return *Get();
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    size_t UseCount() const {
+        Block* block = block_.Get();
+        return block == nullptr ? 0 : block->GetStrongCounter();
+    }
+
+    explicit operator bool() const {
+        return static_cast<bool>(block_);
+    }
+
+private:
+    // Takes over a reference the caller already owns
+    explicit OffsetSharedPtr(Block* block) : block_(block) {
+    }
+
+    void Increase() {
+        if (Block* block = block_.Get()) {
+            block->IncStrong();
+        }
+    }
+
+    void Decrease() {
+        Block* block = block_.Get();
+        if (block != nullptr && block->DecStrong()) {
+            Segment& segment = block->GetSegment();
+            block->~Block();
+            segment.Deallocate(block, sizeof(Block), alignof(Block));
+        }
+    }
+
+    OffsetPtr<Block> block_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const OffsetSharedPtr<T>& left, const OffsetSharedPtr<U>& right) {
+    return left.Get() == right.Get();
+}
+
+// Allocates the object and its counter in `segment` with one allocation
+template <typename T, typename... Args>
+OffsetSharedPtr<T> MakeOffsetShared(Segment& segment, Args&&... args) {
+    static_assert(!std::is_polymorphic_v<T>, "vtables are not valid across processes");
+    using Block = SegmentControlBlock<T>;
+    void* memory = segment.Allocate(sizeof(Block), alignof(Block));
+    try {
+        return OffsetSharedPtr<T>(::new (memory) Block(segment, std::forward<Args>(args)...));
+    } catch (...) {
+        segment.Deallocate(memory, sizeof(Block), alignof(Block));
+        throw;
+    }
+}
+
+template <typename T>
+void Segment::SetRoot(const OffsetSharedPtr<T>& root) {
+    if (root) {
+        root.block_->IncStrong();
+    }
+    Lock();
+    // Released after unlocking: destroying the old root deallocates, which takes the lock
+    OffsetSharedPtr<T> old(static_cast<SegmentControlBlock<T>*>(root_.Get()));
+    root_ = root.block_.Get();
+    Unlock();
+}
+
+template <typename T>
+OffsetSharedPtr<T> Segment::GetRoot() {
+    // The slot's reference cannot be dropped while the lock is held
+    Lock();
+    auto* block = static_cast<SegmentControlBlock<T>*>(root_.Get());
+    if (block != nullptr) {
+        block->IncStrong();
+    }
+    Unlock();
+    return OffsetSharedPtr<T>(block);
+}
+
+template <typename T>
+void Segment::ResetRoot() {
+    Lock();
+    OffsetSharedPtr<T> old(static_cast<SegmentControlBlock<T>*>(root_.Get()));
+    root_ = nullptr;
+    Unlock();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mappings that hold a segment
+
+class MappedSegment {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    MappedSegment() = default;
+
+    // POSIX shared memory object `name` (e.g. "/graph") shared by local processes
+    static MappedSegment CreateShared(const std::string& name, size_t size) {
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        return FormatFd(fd, size, "shm_open " + name);
+    }
+
+    static MappedSegment OpenShared(const std::string& name) {
+        int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        return AttachFd(fd, MAP_SHARED, "shm_open " + name);
+    }
+
+    static void RemoveShared(const std::string& name) {
+        ::shm_unlink(name.c_str());
+    }
+
+    // File-backed segment: the graph built in it is written to `path`
+    static MappedSegment CreateFile(const std::string& path, size_t size) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return FormatFd(fd, size, "open " + path);
+    }
+
+    // Maps a snapshot written with `CreateFile` copy-on-write: usable immediately, without
+    // deserialization, and changes never reach the file
+    static MappedSegment OpenSnapshot(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        return AttachFd(fd, MAP_PRIVATE, "open " + path);
+    }
+
+    MappedSegment(MappedSegment&& other) noexcept
+        : segment_(std::exchange(other.segment_, nullptr)),
+          length_(std::exchange(other.length_, 0)) {
+    }
+
+    MappedSegment(const MappedSegment&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    MappedSegment& operator=(MappedSegment&& other) noexcept {
+        if (this != &other) {
+            Unmap();
+            segment_ = std::exchange(other.segment_, nullptr);
+            length_ = std::exchange(other.length_, 0);
+        }
+        return *this;
+    }
+
+    MappedSegment& operator=(const MappedSegment&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~MappedSegment() {
+        Unmap();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    Segment& operator*() const {
+        return *segment_;
+    }
+
+    Segment* operator->() const {
+        return segment_;
+    }
+
+    Segment* Get() const {
+        return segment_;
+    }
+
+private:
+    static MappedSegment FormatFd(int fd, size_t size, const std::string& what) {
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "ftruncate");
+        }
+        MappedSegment mapped = Map(fd, size, PROT_READ | PROT_WRITE, MAP_SHARED);
+        mapped.segment_ = Segment::Create(mapped.segment_, size);
+        return mapped;
+    }
+
+    static MappedSegment AttachFd(int fd, int flags, const std::string& what) {
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+        struct stat info {};
+        if (::fstat(fd, &info) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fstat");
+        }
+        if (static_cast<size_t>(info.st_size) < sizeof(Segment)) {
+            ::close(fd);
+            throw std::invalid_argument("file is too small to hold a segment");
+        }
+        MappedSegment mapped =
+            Map(fd, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, flags);
+        mapped.segment_ = Segment::Attach(mapped.segment_, mapped.length_);
+        return mapped;
+    }
+
+    // Closes `fd` in every case
+    static MappedSegment Map(int fd, size_t length, int protection, int flags) {
+        void* memory = ::mmap(nullptr, length, protection, flags, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            throw std::system_error(error, std::generic_category(), "mmap");
+        }
+        MappedSegment mapped;
+        mapped.segment_ = static_cast<Segment*>(memory);
+        mapped.length_ = length;
+        return mapped;
+    }
+
+    void Unmap() {
+        if (segment_ != nullptr) {
+            ::munmap(segment_, length_);
+            segment_ = nullptr;
+            length_ = 0;
+        }
+    }
+
+    Segment* segment_ = nullptr;
+    size_t length_ = 0;
+};
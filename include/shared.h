@@ -1,60 +1,230 @@
 #pragma once
 
+#include "block_registry.h"
+#include "cycle_collector.h"
+#include "instrumentation.h"
 #include "sw_fwd.h"  // Forward declaration
 
+#include <atomic>
 #include <cstddef>  // std::nullptr_t
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <new>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 class ESFTBase {};
 
 template <typename T>
 class EnableSharedFromThis;
 
+// Reference counter of `ControlBlock`. With SMART_PTRS_ATOMIC_COUNTERS defined the counter is
+// atomic, and pointers to one object may be copied and released from several threads.
+class BlockCounter {
+public:
+    explicit BlockCounter(size_t value) : value_(value) {
+    }
+
+    // Returns the new value
+    size_t Increment() {
+#ifdef SMART_PTRS_ATOMIC_COUNTERS
+        return value_.fetch_add(1, std::memory_order_relaxed) + 1;
+#else
+        return ++value_;
+#endif
+    }
+
+    // Returns the new value
+    size_t Decrement() {
+#ifdef SMART_PTRS_ATOMIC_COUNTERS
+        return value_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+#else
+        return --value_;
+#endif
+    }
+
+    // Increments unless the counter already dropped to zero
+    bool IncrementIfNotZero() {
+#ifdef SMART_PTRS_ATOMIC_COUNTERS
+        size_t value = value_.load(std::memory_order_relaxed);
+        while (value != 0) {
+            if (value_.compare_exchange_weak(value, value + 1, std::memory_order_acq_rel,
+                                             std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+#else
+        if (value_ == 0) {
+            return false;
+        }
+        ++value_;
+        return true;
+#endif
+    }
+
+    size_t Load() const {
+#ifdef SMART_PTRS_ATOMIC_COUNTERS
+        return value_.load(std::memory_order_acquire);
+#else
+        return value_;
+#endif
+    }
+
+private:
+#ifdef SMART_PTRS_ATOMIC_COUNTERS
+    std::atomic<size_t> value_;
+#else
+    size_t value_;
+#endif
+};
+
+// All strong references together hold one weak reference, so the block outlives the object
+// and is deleted by whoever drops the last weak reference.
 class ControlBlock {
 private:
-    size_t strong_counter_ = 1;
-    size_t weak_counter_ = 0;
+    BlockCounter strong_counter_{1};
+    BlockCounter weak_counter_{1};
 
 public:
     void IncStrong() {
-        ++strong_counter_;
+#ifdef SMART_PTRS_INSTRUMENTATION
+        peak_strong_.Update(strong_counter_.Increment());
+#else
+        strong_counter_.Increment();
+#endif
+    }
+
+    // Promotes a weak reference, fails if the object is already destroyed
+    bool TryIncStrong() {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        if (!strong_counter_.IncrementIfNotZero()) {
+            return false;
+        }
+        peak_strong_.Update(strong_counter_.Load());
+        return true;
+#else
+        return strong_counter_.IncrementIfNotZero();
+#endif
     }
 
+    // Destroys the object with the last strong reference
     void DecStrong() {
-        --strong_counter_;
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+        // Buffered before the decrement: afterwards another thread may free the block
+        if (cycle_node_ != nullptr && strong_counter_.Load() > 1) {
+            cycle_node_->PossibleRoot();
+        }
+#endif
+        if (strong_counter_.Decrement() == 0) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+            if (record_ != nullptr) {
+                instrumentation::OnRelease(*record_, object_, bytes_, peak_strong_.Get(),
+                                           created_ns_);
+            }
+#endif
+            DeleteObject();
+            DecWeak();
+        }
     }
 
     size_t GetStrongCounter() const {
-        return strong_counter_;
+        return strong_counter_.Load();
     }
 
     void IncWeak() {
-        ++weak_counter_;
+        weak_counter_.Increment();
     }
 
+    // Deletes the block with the last weak reference
     void DecWeak() {
-        --weak_counter_;
+        if (weak_counter_.Decrement() == 0) {
+            delete this;
+        }
     }
 
+    // Number of `WeakPtr`s to the block
     size_t GetWeakCounter() const {
-        return weak_counter_;
-    }
-
-    size_t GetCounter() const {
-        return GetStrongCounter() + GetWeakCounter();
+        size_t weak = weak_counter_.Load();
+        return GetStrongCounter() != 0 ? weak - 1 : weak;
     }
 
     virtual ~ControlBlock() = default;
     virtual void DeleteObject() {
     }
+
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+    // Null unless the block takes part in cycle collection
+    cycle::Node* GetCycleNode() const {
+        return cycle_node_;
+    }
+#endif
+
+protected:
+    // Called by derived blocks once the object exists. `block_bytes` live as long as the block,
+    // `object_bytes` are a separately allocated object freed by `DeleteObject`.
+    template <typename T>
+    void OnObjectCreated(const void* object, size_t block_bytes, size_t object_bytes) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        record_ = &instrumentation::RecordFor<T, instrumentation::Kind::kShared>();
+        object_ = object;
+        bytes_ = block_bytes + object_bytes;
+        created_ns_ = instrumentation::NowNs();
+        instrumentation::OnCreate(*record_, object, bytes_);
+#endif
+#ifdef SMART_PTRS_BLOCK_REGISTRY
+        // `std::less` orders pointers into different allocations too
+        auto* begin = reinterpret_cast<const char*>(this);
+        bool object_in_block = !std::less<const void*>()(object, begin) &&
+                               std::less<const void*>()(object, begin + block_bytes);
+        registry_entry_.Register(typeid(T), this, &ReadCounters, block_bytes, object_bytes,
+                                 object_in_block);
+#endif
+        static_cast<void>(object);
+        static_cast<void>(block_bytes);
+        static_cast<void>(object_bytes);
+    }
+
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+    void SetCycleNode(cycle::Node* node) {
+        cycle_node_ = node;
+    }
+#endif
+
+private:
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+    cycle::Node* cycle_node_ = nullptr;
+#endif
+#ifdef SMART_PTRS_INSTRUMENTATION
+    instrumentation::TypeRecord* record_ = nullptr;
+    const void* object_ = nullptr;
+    size_t bytes_ = 0;
+    uint64_t created_ns_ = 0;
+    instrumentation::PeakTracker peak_strong_;
+#endif
+#ifdef SMART_PTRS_BLOCK_REGISTRY
+    static void ReadCounters(const void* owner, size_t* strong, size_t* weak) {
+        auto* block = static_cast<const ControlBlock*>(owner);
+        *strong = block->GetStrongCounter();
+        *weak = block->GetWeakCounter();
+    }
+
+    // Declared after the counters: unlinked before they are gone
+    block_registry::Entry registry_entry_;
+#endif
 };
 
 template <typename T>
 class ControlBlockWithPointer : public ControlBlock {
 public:
     ControlBlockWithPointer(T* ptr) : ptr_(ptr) {
+        if constexpr (std::is_void_v<T>) {
+            OnObjectCreated<T>(ptr, sizeof(*this), 0);
+        } else {
+            OnObjectCreated<T>(ptr, sizeof(*this), ptr != nullptr ? sizeof(T) : 0);
+        }
     }
 
     ~ControlBlockWithPointer() override {
@@ -68,8 +238,33 @@ private:
     T* ptr_;
 };
 
-template <typename T>
+inline constexpr size_t kCacheLineSize = 64;
+
+// Layout policies for `MakeSharedWithLayout`. The object storage inside the control block is
+// aligned to `max(alignof(T), Layout::kAlignment)`.
+
+// Counters and object share the same cache line: the smallest block, the default for `MakeShared`
+struct PackedLayout {
+    static constexpr size_t kAlignment = 1;
+};
+
+// Object starts on its own cache line, so refcount traffic does not invalidate the object's fields
+struct PaddedLayout {
+    static constexpr size_t kAlignment = kCacheLineSize;
+};
+
+// Object storage aligned to an arbitrary power of two (e.g. for SIMD loads)
+template <size_t Alignment>
+struct OverAlignedLayout {
+    static_assert((Alignment & (Alignment - 1)) == 0, "alignment must be a power of two");
+    static constexpr size_t kAlignment = Alignment;
+};
+
+template <typename T, typename Layout = PackedLayout>
 class ControlBlockWithObj : public ControlBlock {
+    static constexpr size_t kStorageAlignment =
+        alignof(T) > Layout::kAlignment ? alignof(T) : Layout::kAlignment;
+
 public:
     ~ControlBlockWithObj() override = default;
 
@@ -80,6 +275,7 @@ public:
     template <typename... Args>
     ControlBlockWithObj(Args&&... args) {
         new (&storage_) T(std::forward<Args>(args)...);
+        OnObjectCreated<T>(GetPointer(), sizeof(*this), 0);
     }
 
     void DeleteObject() override {
@@ -87,7 +283,133 @@ public:
     }
 
 private:
-    std::aligned_storage_t<sizeof(T), alignof(T)> storage_;
+    // Over-aligned blocks are allocated through the aligned `operator new` (C++17), so the
+    // alignment requested here always holds in memory
+    alignas(kStorageAlignment) unsigned char storage_[sizeof(T)];
+};
+
+// Object allocated apart from the counters and freed with the last strong reference, so
+// `WeakPtr`s that outlive it keep only the small block. Costs a second allocation.
+struct SplitLayout {};
+
+// `SplitLayout` for objects of at least `Bytes` bytes, `PackedLayout` for smaller ones
+template <size_t Bytes>
+struct SplitAboveLayout {};
+
+template <typename T>
+class ControlBlockWithObj<T, SplitLayout> : public ControlBlock {
+public:
+    ~ControlBlockWithObj() override = default;
+
+    T* GetPointer() {
+        return object_;
+    }
+
+    template <typename... Args>
+    ControlBlockWithObj(Args&&... args) : object_(new T(std::forward<Args>(args)...)) {
+        OnObjectCreated<T>(object_, sizeof(*this), sizeof(T));
+    }
+
+    void DeleteObject() override {
+        delete object_;
+    }
+
+private:
+    T* object_;
+};
+
+template <typename T, size_t Bytes>
+class ControlBlockWithObj<T, SplitAboveLayout<Bytes>>
+    : public ControlBlockWithObj<T, std::conditional_t<(sizeof(T) >= Bytes), SplitLayout,
+                                                       PackedLayout>> {
+    using Base =
+        ControlBlockWithObj<T, std::conditional_t<(sizeof(T) >= Bytes), SplitLayout, PackedLayout>>;
+
+public:
+    using Base::Base;
+};
+
+// Control block followed by a contiguous array of `T` in the same allocation
+template <typename T>
+class ControlBlockWithArray : public ControlBlock {
+public:
+    // `Create` initializer that value-initializes each element in place
+    struct ValueInit {};
+
+    template <typename Init>
+    static ControlBlockWithArray* Create(size_t size, Init& init) {
+        if (size > (SIZE_MAX - ArrayOffset()) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void* memory = Allocate(ArrayOffset() + size * sizeof(T));
+        auto* block = ::new (memory) ControlBlockWithArray(size);
+        T* data = block->GetPointer();
+        size_t constructed = 0;
+        try {
+            for (; constructed < size; ++constructed) {
+                if constexpr (std::is_same_v<Init, ValueInit>) {
+                    ::new (data + constructed) T();
+                } else if constexpr (std::is_invocable_v<Init&, size_t>) {
+                    ::new (data + constructed) T(init(constructed));
+                } else {
+                    ::new (data + constructed) T(init);
+                }
+            }
+        } catch (...) {
+            std::destroy(data, data + constructed);
+            delete block;
+            throw;
+        }
+        block->template OnObjectCreated<T>(data, ArrayOffset() + size * sizeof(T), 0);
+        return block;
+    }
+
+    ~ControlBlockWithArray() override = default;
+
+    T* GetPointer() {
+        return reinterpret_cast<T*>(reinterpret_cast<char*>(this) + ArrayOffset());
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    void DeleteObject() override {
+        T* data = GetPointer();
+        for (size_t i = size_; i > 0; --i) {
+            std::destroy_at(data + i - 1);
+        }
+    }
+
+    // Memory comes from `Create`, so the block must not be freed with a sized delete
+    static void operator delete(void* memory) {
+        if constexpr (kAlignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(memory, std::align_val_t{kAlignment});
+        } else {
+            ::operator delete(memory);
+        }
+    }
+
+private:
+    static constexpr size_t kAlignment =
+        alignof(T) > alignof(ControlBlock) ? alignof(T) : alignof(ControlBlock);
+
+    explicit ControlBlockWithArray(size_t size) : size_(size) {
+    }
+
+    static void* Allocate(size_t bytes) {
+        if constexpr (kAlignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return ::operator new(bytes, std::align_val_t{kAlignment});
+        } else {
+            return ::operator new(bytes);
+        }
+    }
+
+    static constexpr size_t ArrayOffset() {
+        return (sizeof(ControlBlockWithArray) + alignof(T) - 1) / alignof(T) * alignof(T);
+    }
+
+    size_t size_;
 };
 
 // https://en.cppreference.com/w/cpp/memory/shared_ptr
@@ -100,6 +422,9 @@ public:
     friend class WeakPtr;
     template <typename Y>
     friend class EnableSharedFromThis;
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+    friend class cycle::Tracer;
+#endif
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
@@ -112,55 +437,57 @@ public:
 
     explicit SharedPtr(T* ptr) : block_(new ControlBlockWithPointer<T>(ptr)), ptr_(ptr) {
         if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
-            ptr->self_ = *this;
+            if (ptr != nullptr) {
+                ptr->self_ = *this;
+            }
         }
     }
 
     template <typename Y>
     explicit SharedPtr(Y* ptr) : block_(new ControlBlockWithPointer<Y>(ptr)), ptr_(ptr) {
         if constexpr (std::is_convertible_v<Y*, ESFTBase*>) {
-            ptr->self_ = *this;
+            if (ptr != nullptr) {
+                ptr->self_ = *this;
+            }
         }
     }
 
     SharedPtr(const SharedPtr<T>& other) : block_(other.block_), ptr_(other.ptr_) {
-        if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
-            ptr_->self_ = *this;
-        }
         Increase();
     }
 
     template <typename Y>
     SharedPtr(const SharedPtr<Y>& other) : block_(other.block_), ptr_(other.ptr_) {
-        if constexpr (std::is_convertible_v<Y*, ESFTBase*>) {
-            ptr_->self_ = *this;
-        }
         Increase();
     }
 
     SharedPtr(SharedPtr<T>&& other) : block_(other.block_), ptr_(other.ptr_) {
-        if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
-            ptr_->self_ = *this;
-        }
         other.block_ = nullptr;
         other.ptr_ = nullptr;
     }
 
     template <typename Y>
     SharedPtr(SharedPtr<Y>&& other) : block_(other.block_), ptr_(other.ptr_) {
-        if constexpr (std::is_convertible_v<Y*, ESFTBase*>) {
-            ptr_->self_ = *this;
-        }
         other.block_ = nullptr;
         other.ptr_ = nullptr;
     }
 
-    SharedPtr(ControlBlockWithObj<T>* block) : block_(block), ptr_(block->GetPointer()) {
+    template <typename Layout>
+    SharedPtr(ControlBlockWithObj<T, Layout>* block) : block_(block), ptr_(block->GetPointer()) {
         if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
             ptr_->self_ = *this;
         }
     }
 
+    // Points to the first element of the batch
+    SharedPtr(ControlBlockWithArray<T>* block) : block_(block), ptr_(block->GetPointer()) {
+        if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
+            for (size_t i = 0; i < block->Size(); ++i) {
+                ptr_[i].self_ = SharedPtr(*this, ptr_ + i);
+            }
+        }
+    }
+
     // Aliasing constructor
     // #8 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
     template <typename Y>
@@ -171,30 +498,22 @@ public:
     // Promote `WeakPtr`
     // #11 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
     explicit SharedPtr(const WeakPtr<T>& other) : block_(other.block_), ptr_(other.ptr_) {
-        if (other.Expired()) {
+        if (block_ == nullptr || !block_->TryIncStrong()) {
             throw BadWeakPtr{};
         }
-        Increase();
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
 
+    // The old object is released last: it may own `other`, or be `other` itself
     SharedPtr& operator=(const SharedPtr& other) {
-        Decrease();
-        block_ = other.block_;
-        ptr_ = other.ptr_;
-        Increase();
+        SharedPtr(other).Swap(*this);
         return *this;
     }
 
     SharedPtr& operator=(SharedPtr&& other) {
-        Decrease();
-        block_ = other.block_;
-        ptr_ = other.ptr_;
-        other.ptr_ = nullptr;
-        other.block_ = nullptr;
-
+        SharedPtr(std::move(other)).Swap(*this);
         return *this;
     }
 
@@ -215,16 +534,12 @@ public:
     }
 
     void Reset(T* ptr) {
-        Decrease();
-        block_ = new ControlBlockWithPointer<T>(ptr);
-        ptr_ = ptr;
+        SharedPtr(ptr).Swap(*this);
     }
 
     template <typename Y>
     void Reset(Y* ptr) {
-        Decrease();
-        block_ = new ControlBlockWithPointer<Y>(ptr);
-        ptr_ = ptr;
+        SharedPtr(ptr).Swap(*this);
     }
 
     void Swap(SharedPtr& other) {
@@ -248,7 +563,7 @@ public:
     }
 
     size_t UseCount() const {
-        if (ptr_ != nullptr) {
+        if (block_ != nullptr) {
             return block_->GetStrongCounter();
         }
         return 0;
@@ -258,30 +573,45 @@ public:
         return ptr_ != nullptr;
     }
 
+    // Order, equality and hash of the control block, as `std::owner_less`: aliasing pointers to
+    // one object compare equal, and an expired `WeakPtr` keeps its position
+    template <typename Y>
+    bool OwnerBefore(const SharedPtr<Y>& other) const {
+        return std::less<const ControlBlock*>()(block_, other.block_);
+    }
+
+    template <typename Y>
+    bool OwnerBefore(const WeakPtr<Y>& other) const {
+        return std::less<const ControlBlock*>()(block_, other.block_);
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const SharedPtr<Y>& other) const {
+        return block_ == other.block_;
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const WeakPtr<Y>& other) const {
+        return block_ == other.block_;
+    }
+
+    size_t OwnerHash() const {
+        return std::hash<const ControlBlock*>()(block_);
+    }
+
 private:
+    // Adopts a strong reference the caller already owns
+    SharedPtr(ControlBlock* block, T* ptr) : block_(block), ptr_(ptr) {
+    }
+
     void Decrease() {
-        if (ptr_ != nullptr) {
+        if (block_ != nullptr) {
             block_->DecStrong();
-            if (UseCount() == 0) {
-                size_t cnt = block_->GetWeakCounter();
-                block_->DeleteObject();
-                if (cnt == 0) {
-                    if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
-                        if (!ptr_->self_.Expired()) {
-                            ptr_->self_.Reset();
-                        }
-                        block_ = nullptr;
-                    }
-                    delete block_;
-                    block_ = nullptr;
-                }
-                ptr_ = nullptr;
-            }
         }
     }
 
     void Increase() {
-        if (ptr_ != nullptr) {
+        if (block_ != nullptr) {
             block_->IncStrong();
         }
     }
@@ -300,6 +630,79 @@ SharedPtr<T> MakeShared(Args&&... args) {
     return SharedPtr<T>(new ControlBlockWithObj<T>(std::forward<Args>(args)...));
 }
 
+// Same as `MakeShared`, but places the object according to `Layout` (`PackedLayout`,
+// `PaddedLayout`, `OverAlignedLayout<N>`, `SplitLayout` or `SplitAboveLayout<N>`)
+template <typename T, typename Layout, typename... Args>
+SharedPtr<T> MakeSharedWithLayout(Args&&... args) {
+    return SharedPtr<T>(new ControlBlockWithObj<T, Layout>(std::forward<Args>(args)...));
+}
+
+// Same as `MakeShared`, but the object's storage is returned on the last strong release even
+// while `WeakPtr`s remain
+template <typename T, typename... Args>
+SharedPtr<T> MakeSharedSplit(Args&&... args) {
+    return MakeSharedWithLayout<T, SplitLayout>(std::forward<Args>(args)...);
+}
+
+#ifdef SMART_PTRS_CYCLE_COLLECTOR
+// `MakeShared` block taking part in cycle collection, `T` must have `void Trace(cycle::Tracer&)`
+template <typename T>
+class ControlBlockCollected : public ControlBlockWithObj<T>, public cycle::Node {
+public:
+    template <typename... Args>
+    ControlBlockCollected(Args&&... args) : ControlBlockWithObj<T>(std::forward<Args>(args)...) {
+        this->SetCycleNode(this);
+    }
+
+private:
+    size_t StrongCount() const override {
+        return this->GetStrongCounter();
+    }
+
+    void TraceObject(cycle::Tracer& tracer) override {
+        this->GetPointer()->Trace(tracer);
+    }
+
+    void Pin() override {
+        this->IncStrong();
+    }
+
+    void Unpin() override {
+        this->DecStrong();
+    }
+};
+
+// Same as `MakeShared`, but cycles through the object are reclaimed by `cycle::Collector`
+template <typename T, typename... Args>
+SharedPtr<T> MakeCollected(Args&&... args) {
+    ControlBlockWithObj<T>* block = new ControlBlockCollected<T>(std::forward<Args>(args)...);
+    return SharedPtr<T>(block);
+}
+#endif
+
+// Allocate one control block for `size` contiguous objects. Every returned pointer aliases
+// the same block, so all objects are destroyed together when the last one is released.
+// `init` is either a callable taking the element index or a value to copy into each element.
+// `SharedFromThis()` of an element returns a pointer to that element sharing the batch's block.
+template <typename T, typename Init>
+std::vector<SharedPtr<T>> MakeSharedBatch(size_t size, Init&& init) {
+    std::vector<SharedPtr<T>> batch;
+    if (size == 0) {
+        return batch;
+    }
+    batch.reserve(size);
+    SharedPtr<T> owner(ControlBlockWithArray<T>::Create(size, init));
+    for (size_t i = 0; i < size; ++i) {
+        batch.emplace_back(owner, owner.Get() + i);
+    }
+    return batch;
+}
+
+template <typename T>
+std::vector<SharedPtr<T>> MakeSharedBatch(size_t size) {
+    return MakeSharedBatch<T>(size, typename ControlBlockWithArray<T>::ValueInit{});
+}
+
 // Look for usage examples in tests
 template <typename T>
 class EnableSharedFromThis : public ESFTBase {
@@ -1,10 +1,25 @@
 #pragma once
 
 #include "compressed_pair.h"
+#include "instrumentation.h"
 
 #include <cstddef>  // std::nullptr_t
+#include <type_traits>
 #include <utility>
 
+// With SMART_PTRS_TRIVIAL_ABI defined (CMake option of the same name) and a compiler that
+// supports it, `UniquePtr` is `[[clang::trivial_abi]]`: with a stateless deleter it is passed
+// and returned in a register like a raw pointer. The callee then destroys by-value arguments,
+// so they die at the end of the callee instead of the caller's full-expression.
+#if defined(SMART_PTRS_TRIVIAL_ABI) && defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::trivial_abi)
+#define SMART_PTRS_TRIVIAL_ABI_ATTRIBUTE [[clang::trivial_abi]]
+#endif
+#endif
+#ifndef SMART_PTRS_TRIVIAL_ABI_ATTRIBUTE
+#define SMART_PTRS_TRIVIAL_ABI_ATTRIBUTE
+#endif
+
 template <typename T>
 struct DefaultDeleter {
     constexpr DefaultDeleter() noexcept = default;
@@ -36,19 +51,32 @@ struct DefaultDeleter<T[]> {
 
 // Primary template
 template <typename T, typename Deleter = DefaultDeleter<T>>
-class UniquePtr {
+class SMART_PTRS_TRIVIAL_ABI_ATTRIBUTE UniquePtr {
 public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
     explicit UniquePtr(T* ptr = nullptr) noexcept : pair_(ptr, Deleter()) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        instrumentation::TrackUnique<T>(ptr);
+#endif
     }
     UniquePtr(T* ptr, Deleter deleter) noexcept : pair_(ptr, std::forward<Deleter>(deleter)) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        instrumentation::TrackUnique<T>(ptr);
+#endif
+    }
+
+    UniquePtr(UniquePtr&& other) noexcept
+        : pair_(other.Detach(), std::move(other.GetDeleter())) {
     }
 
     template <class U, typename NewDeleter>
     UniquePtr(UniquePtr<U, NewDeleter>&& other) noexcept
-        : pair_(other.Release(), std::forward<NewDeleter>(other.GetDeleter())) {
+        : pair_(other.Detach(), std::forward<NewDeleter>(other.GetDeleter())) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Retrack<U>();
+#endif
     }
 
     UniquePtr(UniquePtr& other) = delete;
@@ -57,10 +85,19 @@ public:
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
+    UniquePtr& operator=(UniquePtr&& other) noexcept {
+        Replace(other.Detach());
+        GetDeleter() = std::move(other.GetDeleter());
+        return *this;
+    }
+
     template <typename U, typename NewDeleter>
     UniquePtr& operator=(UniquePtr<U, NewDeleter>&& other) noexcept {
-        Reset(other.Release());
+        Replace(other.Detach());
         GetDeleter() = std::forward<NewDeleter>(other.GetDeleter());
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Retrack<U>();
+#endif
         return *this;
     }
 
@@ -80,18 +117,20 @@ public:
     // Modifiers
 
     T* Release() noexcept {
-        T* ptr = GetPointer();
-        GetPointer() = nullptr;
-        return ptr;
+#ifdef SMART_PTRS_INSTRUMENTATION
+        instrumentation::UntrackUnique<T>(GetPointer());
+#endif
+        return Detach();
     }
 
     void Reset(T* ptr = nullptr) noexcept {
         if (ptr == GetPointer()) {
             return;
         }
-        T* old_ptr = GetPointer();
-        GetPointer() = ptr;
-        GetDeleter()(old_ptr);
+#ifdef SMART_PTRS_INSTRUMENTATION
+        instrumentation::TrackUnique<T>(ptr);
+#endif
+        Replace(ptr);
     }
 
     void Swap(UniquePtr& other) noexcept {
@@ -130,6 +169,9 @@ public:
     }
 
 private:
+    template <typename U, typename NewDeleter>
+    friend class UniquePtr;
+
     CompressedPair<T*, Deleter> pair_;
     T*& GetPointer() {
         return pair_.GetFirst();
@@ -139,29 +181,76 @@ private:
         return pair_.GetFirst();
     }
 
+    // Gives up ownership without touching instrumentation (ownership moves to another pointer)
+    T* Detach() noexcept {
+        T* ptr = GetPointer();
+        GetPointer() = nullptr;
+        return ptr;
+    }
+
+    // Takes `ptr` and destroys the previous object
+    void Replace(T* ptr) noexcept {
+        T* old_ptr = GetPointer();
+        GetPointer() = ptr;
+#ifdef SMART_PTRS_INSTRUMENTATION
+        instrumentation::UntrackUnique<T>(old_ptr);
+#endif
+        if (old_ptr != nullptr) {
+            GetDeleter()(old_ptr);
+        }
+    }
+
     void Clean() {
         if (GetPointer() != nullptr) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+            instrumentation::UntrackUnique<T>(GetPointer());
+#endif
             GetDeleter()(GetPointer());
             GetPointer() = nullptr;
         }
     }
+
+#ifdef SMART_PTRS_INSTRUMENTATION
+    // The object now lives under `T` instead of `U`
+    template <typename U>
+    void Retrack() {
+        if constexpr (!std::is_same_v<U, T>) {
+            instrumentation::UntrackUnique<U>(GetPointer());
+            instrumentation::TrackUnique<T>(GetPointer());
+        }
+    }
+#endif
 };
 
-// Specialization for arrays
+// Specialization for arrays. Instrumentation counts them under `T[]`, see
+// `instrumentation::ArrayBytes` for their byte counts.
 template <typename T, typename Deleter>
-class UniquePtr<T[], Deleter> {
+class SMART_PTRS_TRIVIAL_ABI_ATTRIBUTE UniquePtr<T[], Deleter> {
 public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
     explicit UniquePtr(T* ptr = nullptr) noexcept : pair_(ptr, Deleter()) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Track(ptr);
+#endif
     }
     UniquePtr(T* ptr, Deleter deleter) noexcept : pair_(ptr, std::forward<Deleter>(deleter)) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Track(ptr);
+#endif
+    }
+
+    UniquePtr(UniquePtr&& other) noexcept
+        : pair_(other.Detach(), std::move(other.GetDeleter())) {
     }
 
     template <class U, typename NewDeleter>
     UniquePtr(UniquePtr<U, NewDeleter>&& other) noexcept
-        : pair_(other.Release(), std::forward<NewDeleter>(other.GetDeleter())) {
+        : pair_(other.Detach(), std::forward<NewDeleter>(other.GetDeleter())) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Retrack<U>();
+#endif
     }
 
     UniquePtr(UniquePtr& other) = delete;
@@ -170,10 +259,19 @@ public:
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
+    UniquePtr& operator=(UniquePtr&& other) noexcept {
+        Replace(other.Detach());
+        GetDeleter() = std::move(other.GetDeleter());
+        return *this;
+    }
+
     template <typename U, typename NewDeleter>
     UniquePtr& operator=(UniquePtr<U, NewDeleter>&& other) noexcept {
-        Reset(other.Release());
+        Replace(other.Detach());
         GetDeleter() = std::forward<NewDeleter>(other.GetDeleter());
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Retrack<U>();
+#endif
         return *this;
     }
 
@@ -193,18 +291,20 @@ public:
     // Modifiers
 
     T* Release() noexcept {
-        T* ptr = GetPointer();
-        GetPointer() = nullptr;
-        return ptr;
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Untrack(GetPointer());
+#endif
+        return Detach();
     }
 
     void Reset(T* ptr = nullptr) noexcept {
         if (ptr == GetPointer()) {
             return;
         }
-        T* old_ptr = GetPointer();
-        GetPointer() = ptr;
-        GetDeleter()(old_ptr);
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Track(ptr);
+#endif
+        Replace(ptr);
     }
 
     void Swap(UniquePtr& other) noexcept {
@@ -247,6 +347,9 @@ public:
     }
 
 private:
+    template <typename U, typename NewDeleter>
+    friend class UniquePtr;
+
     CompressedPair<T*, Deleter> pair_;
     T*& GetPointer() {
         return pair_.GetFirst();
@@ -256,8 +359,287 @@ private:
         return pair_.GetFirst();
     }
 
+    // Gives up ownership without touching instrumentation (ownership moves to another pointer)
+    T* Detach() noexcept {
+        T* ptr = GetPointer();
+        GetPointer() = nullptr;
+        return ptr;
+    }
+
+    // Takes `ptr` and destroys the previous array
+    void Replace(T* ptr) noexcept {
+        T* old_ptr = GetPointer();
+        GetPointer() = ptr;
+#ifdef SMART_PTRS_INSTRUMENTATION
+        Untrack(old_ptr);
+#endif
+        if (old_ptr != nullptr) {
+            GetDeleter()(old_ptr);
+        }
+    }
+
     void Clean() {
-        GetDeleter()(GetPointer());
+        if (GetPointer() != nullptr) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+            Untrack(GetPointer());
+#endif
+            GetDeleter()(GetPointer());
+            GetPointer() = nullptr;
+        }
+    }
+
+#ifdef SMART_PTRS_INSTRUMENTATION
+    void Track(const T* ptr) const {
+        instrumentation::TrackUnique<T[]>(ptr, instrumentation::ArrayBytes(GetDeleter()));
+    }
+
+    void Untrack(const T* ptr) const {
+        instrumentation::UntrackUnique<T[]>(ptr, instrumentation::ArrayBytes(GetDeleter()));
+    }
+
+    // The array now lives under `T[]` instead of `U`
+    template <typename U>
+    void Retrack() {
+        if constexpr (!std::is_same_v<U, T[]>) {
+            size_t bytes = instrumentation::ArrayBytes(GetDeleter());
+            size_t old_bytes = std::is_array_v<U> ? bytes : instrumentation::SizeOf<U>();
+            instrumentation::UntrackUnique<U>(GetPointer(), old_bytes);
+            instrumentation::TrackUnique<T[]>(GetPointer(), bytes);
+        }
+    }
+#endif
+};
+
+// Deleter of `AnyUniquePtr`: one function pointer that destroys the object and identifies its
+// type, so `Cast<T>()` is checked without RTTI
+class FnDeleter {
+    enum class Op { kDelete, kUntrack, kTypeTag };
+    using Manager = const void* (*)(Op, void*);
+
+public:
+    constexpr FnDeleter() noexcept = default;
+
+    // Destroys a `T` with a default-constructed `D`
+    template <typename T, typename D = DefaultDeleter<T>>
+    static constexpr FnDeleter For() noexcept {
+        static_assert(std::is_empty_v<D> && std::is_default_constructible_v<D>,
+                      "only stateless deleters fit in a function pointer");
+        return FnDeleter(&Manage<T, D>);
+    }
+
+    void operator()(void* ptr) const {
+        manager_(Op::kDelete, ptr);
+    }
+
+    // Whether the deleter was made for `T`. An object stored as `const T` is only seen as
+    // `const T`, a mutable one as either.
+    template <typename T>
+    bool Holds() const noexcept {
+        if (manager_ == nullptr) {
+            return false;
+        }
+        const void* tag = manager_(Op::kTypeTag, nullptr);
+        return tag == &kTypeTag<T> ||
+               (std::is_const_v<T> && tag == &kTypeTag<std::remove_const_t<T>>);
+    }
+
+private:
+    template <typename U, typename NewDeleter>
+    friend class UniquePtr;
+
+    constexpr explicit FnDeleter(Manager manager) noexcept : manager_(manager) {
+    }
+
+    // Ownership leaves the `AnyUniquePtr` without destroying the object
+    void Untrack(void* ptr) const {
+        manager_(Op::kUntrack, ptr);
+    }
+
+    // One address per type
+    template <typename T>
+    static inline const char kTypeTag = 0;
+
+    template <typename T, typename D>
+    static const void* Manage(Op op, void* ptr) {
+        switch (op) {
+            case Op::kDelete:
+#ifdef SMART_PTRS_INSTRUMENTATION
+                instrumentation::UntrackUnique<T>(ptr);
+#endif
+                D()(static_cast<T*>(ptr));
+                return nullptr;
+            case Op::kUntrack:
+#ifdef SMART_PTRS_INSTRUMENTATION
+                instrumentation::UntrackUnique<T>(ptr);
+#endif
+                return nullptr;
+            case Op::kTypeTag:
+                return &kTypeTag<T>;
+        }
+        return nullptr;
+    }
+
+    Manager manager_ = nullptr;
+};
+
+// Owning pointer to an object of any type: the pointer and a `FnDeleter`, two words, no
+// allocation. Converts from `UniquePtr<T, D>` with a stateless `D`.
+template <>
+class SMART_PTRS_TRIVIAL_ABI_ATTRIBUTE UniquePtr<void, FnDeleter> {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    UniquePtr() noexcept = default;
+
+    UniquePtr(std::nullptr_t) noexcept {
+    }
+
+    UniquePtr(void* ptr, FnDeleter deleter) noexcept : pair_(ptr, deleter) {
+    }
+
+    // Takes ownership of `ptr`, destroyed with `delete`
+    template <typename T, typename = std::enable_if_t<!std::is_void_v<T>>>
+    explicit UniquePtr(T* ptr) noexcept : pair_(Erase(ptr), FnDeleter::For<T>()) {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        instrumentation::TrackUnique<T>(ptr);
+#endif
+    }
+
+    UniquePtr(UniquePtr&& other) noexcept : pair_(other.Detach(), other.GetDeleter()) {
+    }
+
+    template <typename T, typename D,
+              typename = std::enable_if_t<!std::is_void_v<T> && !std::is_array_v<T>>>
+    UniquePtr(UniquePtr<T, D>&& other) noexcept
+        : pair_(Erase(other.Detach()), FnDeleter::For<T, D>()) {
+    }
+
+    UniquePtr(UniquePtr& other) = delete;
+
+    UniquePtr& operator=(UniquePtr& other) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    UniquePtr& operator=(UniquePtr&& other) noexcept {
+        FnDeleter deleter = other.GetDeleter();
+        Replace(other.Detach(), deleter);
+        return *this;
+    }
+
+    template <typename T, typename D,
+              typename = std::enable_if_t<!std::is_void_v<T> && !std::is_array_v<T>>>
+    UniquePtr& operator=(UniquePtr<T, D>&& other) noexcept {
+        Replace(Erase(other.Detach()), FnDeleter::For<T, D>());
+        return *this;
+    }
+
+    UniquePtr& operator=(std::nullptr_t) noexcept {
+        Reset();
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~UniquePtr() noexcept {
+        Clean();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void* Release() noexcept {
+#ifdef SMART_PTRS_INSTRUMENTATION
+        if (GetPointer() != nullptr) {
+            GetDeleter().Untrack(GetPointer());
+        }
+#endif
+        return Detach();
+    }
+
+    void Reset() noexcept {
+        Clean();
+    }
+
+    void Reset(void* ptr, FnDeleter deleter) noexcept {
+        if (ptr == GetPointer()) {
+            return;
+        }
+        Replace(ptr, deleter);
+    }
+
+    void Swap(UniquePtr& other) noexcept {
+        std::swap(GetPointer(), other.GetPointer());
+        std::swap(GetDeleter(), other.GetDeleter());
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    void* Get() const noexcept {
+        return GetPointer();
+    }
+
+    FnDeleter& GetDeleter() noexcept {
+        return pair_.GetSecond();
+    }
+
+    const FnDeleter& GetDeleter() const noexcept {
+        return pair_.GetSecond();
+    }
+
+    explicit operator bool() const noexcept {
+        return GetPointer() != nullptr;
+    }
+
+    // The object if it was stored as a `T`, null otherwise
+    template <typename T>
+    T* Cast() const noexcept {
+        return GetDeleter().Holds<T>() ? static_cast<T*>(GetPointer()) : nullptr;
+    }
+
+private:
+    CompressedPair<void*, FnDeleter> pair_;
+
+    // Cv-qualifiers are kept by the deleter's type tag, so `Cast` cannot drop them
+    template <typename T>
+    static void* Erase(T* ptr) noexcept {
+        return const_cast<void*>(static_cast<const volatile void*>(ptr));
+    }
+
+    void*& GetPointer() {
+        return pair_.GetFirst();
+    }
+
+    void* GetPointer() const {
+        return pair_.GetFirst();
+    }
+
+    void* Detach() noexcept {
+        void* ptr = GetPointer();
         GetPointer() = nullptr;
+        return ptr;
+    }
+
+    // Takes `ptr` and destroys the previous object
+    void Replace(void* ptr, FnDeleter deleter) noexcept {
+        void* old_ptr = GetPointer();
+        FnDeleter old_deleter = GetDeleter();
+        GetPointer() = ptr;
+        GetDeleter() = deleter;
+        if (old_ptr != nullptr) {
+            old_deleter(old_ptr);
+        }
+    }
+
+    void Clean() {
+        if (GetPointer() != nullptr) {
+            GetDeleter()(GetPointer());
+            GetPointer() = nullptr;
+        }
     }
 };
+
+using AnyUniquePtr = UniquePtr<void, FnDeleter>;
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "unique.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>  // std::nullptr_t
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+// Large `UniquePtr<T[]>` buffers: aligned, default-initialized and mmap-backed.
+// Aligned and mapped buffers hold plain data only, so their deleters never run destructors.
+
+template <typename T>
+inline constexpr bool kIsUnboundedArrayV = std::is_array_v<T> && std::extent_v<T> == 0;
+
+template <typename T>
+inline constexpr bool kIsPlainBufferElementV =
+    std::is_trivially_default_constructible_v<T> && std::is_trivially_destructible_v<T>;
+
+namespace buffer_detail {
+
+inline size_t RoundUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Bytes of `count` elements, throwing as `new Element[count]` does when they do not fit
+template <typename Element>
+size_t ArrayBytes(size_t count) {
+    if (count > SIZE_MAX / sizeof(Element)) {
+        throw std::bad_array_new_length();
+    }
+    return count * sizeof(Element);
+}
+
+// Same as `RoundUp` for allocation sizes, throws instead of wrapping around
+inline size_t RoundUpBytes(size_t bytes, size_t alignment) {
+    if (bytes > SIZE_MAX - (alignment - 1)) {
+        throw std::bad_array_new_length();
+    }
+    return RoundUp(bytes, alignment);
+}
+
+inline size_t PageSize() {
+    static const size_t kPageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return kPageSize;
+}
+
+}  // namespace buffer_detail
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Aligned buffers
+
+// Frees memory obtained from `std::aligned_alloc`
+struct AlignedDeleter {
+    template <typename T>
+    void operator()(T* p) const {
+        std::free(const_cast<std::remove_cv_t<T>*>(p));
+    }
+};
+
+// Value-initialized array of `size` elements whose first element is aligned to `alignment`
+// (e.g. 64 for AVX-512 loads). `alignment` must be a power of two.
+template <typename T>
+std::enable_if_t<kIsUnboundedArrayV<T>, UniquePtr<T, AlignedDeleter>> MakeUniqueAligned(
+    size_t size, size_t alignment) {
+    using Element = std::remove_extent_t<T>;
+    static_assert(kIsPlainBufferElementV<Element>, "aligned buffers hold trivial types only");
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        throw std::invalid_argument("alignment must be a power of two");
+    }
+    if (alignment < alignof(Element)) {
+        alignment = alignof(Element);
+    }
+    // `std::aligned_alloc` requires the size to be a multiple of the alignment
+    size_t bytes = buffer_detail::RoundUpBytes(buffer_detail::ArrayBytes<Element>(size), alignment);
+    void* memory = std::aligned_alloc(alignment, bytes == 0 ? alignment : bytes);
+    if (memory == nullptr) {
+        throw std::bad_alloc{};
+    }
+    auto* data = static_cast<Element*>(memory);
+    std::uninitialized_value_construct_n(data, size);
+    return UniquePtr<T, AlignedDeleter>(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Default-initialized buffers
+
+// Same as `new T[size]` without `()`: trivial elements are left uninitialized, so a buffer
+// that is about to be overwritten is not zeroed first
+template <typename T>
+std::enable_if_t<kIsUnboundedArrayV<T>, UniquePtr<T>> MakeUniqueForOverwrite(size_t size) {
+    return UniquePtr<T>(new std::remove_extent_t<T>[size]);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// mmap-backed buffers
+
+enum class MapFlags : unsigned {
+    kNone = 0,
+    // Align the mapping to 2 MiB and ask for transparent huge pages (`MADV_HUGEPAGE`)
+    kHugePages = 1u << 0,
+    // Fault in every page up front instead of on first touch
+    kPopulate = 1u << 1,
+};
+
+inline constexpr MapFlags operator|(MapFlags left, MapFlags right) {
+    return static_cast<MapFlags>(static_cast<unsigned>(left) | static_cast<unsigned>(right));
+}
+
+inline constexpr bool HasFlag(MapFlags flags, MapFlags flag) {
+    return (static_cast<unsigned>(flags) & static_cast<unsigned>(flag)) != 0;
+}
+
+inline constexpr size_t kHugePageSize = size_t{2} << 20;
+
+// Unmaps `length` bytes starting at the pointer
+class MunmapDeleter {
+public:
+    MunmapDeleter() = default;
+
+    explicit MunmapDeleter(size_t length) : length_(length) {
+    }
+
+    template <typename T>
+    void operator()(T* p) const {
+        if (p != nullptr) {
+            ::munmap(const_cast<std::remove_cv_t<T>*>(p), length_);
+        }
+    }
+
+    size_t GetLength() const {
+        return length_;
+    }
+
+private:
+    size_t length_ = 0;
+};
+
+namespace buffer_detail {
+
+inline void* MapAnonymous(size_t length, MapFlags flags) {
+    bool huge = HasFlag(flags, MapFlags::kHugePages);
+    if (huge && length > SIZE_MAX - kHugePageSize) {
+        throw std::bad_array_new_length();
+    }
+    size_t reserve = huge ? length + kHugePageSize : length;
+    void* memory = ::mmap(nullptr, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    if (!huge) {
+        return memory;
+    }
+
+    // Trim the reservation down to a 2 MiB aligned window, so every huge page is usable
+    auto begin = reinterpret_cast<uintptr_t>(memory);
+    uintptr_t aligned = RoundUp(begin, kHugePageSize);
+    if (aligned != begin) {
+        ::munmap(memory, aligned - begin);
+    }
+    uintptr_t tail = aligned + length;
+    if (tail != begin + reserve) {
+        ::munmap(reinterpret_cast<void*>(tail), begin + reserve - tail);
+    }
+#ifdef MADV_HUGEPAGE
+    ::madvise(reinterpret_cast<void*>(aligned), length, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<void*>(aligned);
+}
+
+inline void Populate(void* memory, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+    if (::madvise(memory, length, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    // Older kernels: touch one byte per page
+    auto* bytes = static_cast<volatile unsigned char*>(memory);
+    for (size_t offset = 0; offset < length; offset += PageSize()) {
+        bytes[offset] = 0;
+    }
+}
+
+}  // namespace buffer_detail
+
+// Zero-filled array of `size` elements in a private anonymous mapping. Huge-page hinting is
+// applied before populating, so pre-faulting already uses huge pages.
+template <typename T>
+std::enable_if_t<kIsUnboundedArrayV<T>, UniquePtr<T, MunmapDeleter>> MakeUniqueMapped(
+    size_t size, MapFlags flags = MapFlags::kNone) {
+    using Element = std::remove_extent_t<T>;
+    static_assert(kIsPlainBufferElementV<Element>, "mapped buffers hold trivial types only");
+    if (alignof(Element) > buffer_detail::PageSize()) {
+        throw std::invalid_argument("mapping is only page aligned");
+    }
+
+    size_t granularity =
+        HasFlag(flags, MapFlags::kHugePages) ? kHugePageSize : buffer_detail::PageSize();
+    size_t length =
+        buffer_detail::RoundUpBytes(buffer_detail::ArrayBytes<Element>(size), granularity);
+    if (length == 0) {
+        length = granularity;
+    }
+    void* memory = buffer_detail::MapAnonymous(length, flags);
+    if (HasFlag(flags, MapFlags::kPopulate)) {
+        buffer_detail::Populate(memory, length);
+    }
+    return UniquePtr<T, MunmapDeleter>(static_cast<Element*>(memory), MunmapDeleter(length));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bounds-carrying array owner
+
+template <typename T, typename Deleter = DefaultDeleter<T[]>>
+class UniqueSpan {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    UniqueSpan() = default;
+
+    UniqueSpan(UniquePtr<T[], Deleter>&& ptr, size_t size) noexcept
+        : ptr_(std::move(ptr)), size_(ptr_ ? size : 0) {
+    }
+
+    UniqueSpan(UniqueSpan&& other) noexcept
+        : ptr_(std::move(other.ptr_)), size_(std::exchange(other.size_, 0)) {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    UniqueSpan& operator=(UniqueSpan&& other) noexcept {
+        ptr_ = std::move(other.ptr_);
+        size_ = std::exchange(other.size_, 0);
+        return *this;
+    }
+
+    UniqueSpan& operator=(std::nullptr_t) noexcept {
+        Reset();
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    UniquePtr<T[], Deleter> Release() noexcept {
+        size_ = 0;
+        return std::move(ptr_);
+    }
+
+    void Reset() noexcept {
+        ptr_.Reset();
+        size_ = 0;
+    }
+
+    void Swap(UniqueSpan& other) noexcept {
+        ptr_.Swap(other.ptr_);
+        std::swap(size_, other.size_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const noexcept {
+        return ptr_.Get();
+    }
+
+    size_t Size() const noexcept {
+        return size_;
+    }
+
+    bool Empty() const noexcept {
+        return size_ == 0;
+    }
+
+    Deleter& GetDeleter() noexcept {
+        return ptr_.GetDeleter();
+    }
+
+    const Deleter& GetDeleter() const noexcept {
+        return ptr_.GetDeleter();
+    }
+
+    explicit operator bool() const noexcept {
+        return static_cast<bool>(ptr_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Element access
+
+    T& operator[](size_t i) const noexcept {
+        return Get()[i];
+    }
+
+    T& At(size_t i) const {
+        if (i >= size_) {
+            throw std::out_of_range("UniqueSpan index out of range");
+        }
+        return Get()[i];
+    }
+
+    T* begin() const noexcept {
+        return Get();
+    }
+
+    T* end() const noexcept {
+        return Get() + size_;
+    }
+
+private:
+    UniquePtr<T[], Deleter> ptr_;
+    size_t size_ = 0;
+};
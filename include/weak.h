@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <utility>
 #include "sw_fwd.h"  // Forward declaration
 #include "shared.h"
@@ -96,10 +97,35 @@ public:
     }
 
     SharedPtr<T> Lock() const {
-        if (Expired()) {
+        if (block_ == nullptr || !block_->TryIncStrong()) {
             return SharedPtr<T>();
         }
-        return SharedPtr<T>(*this);
+        return SharedPtr<T>(block_, ptr_);
+    }
+
+    // Same as in `SharedPtr`
+    template <typename Y>
+    bool OwnerBefore(const WeakPtr<Y>& other) const {
+        return std::less<const ControlBlock*>()(block_, other.block_);
+    }
+
+    template <typename Y>
+    bool OwnerBefore(const SharedPtr<Y>& other) const {
+        return std::less<const ControlBlock*>()(block_, other.block_);
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const WeakPtr<Y>& other) const {
+        return block_ == other.block_;
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const SharedPtr<Y>& other) const {
+        return block_ == other.block_;
+    }
+
+    size_t OwnerHash() const {
+        return std::hash<const ControlBlock*>()(block_);
     }
 
 private:
@@ -112,12 +138,32 @@ private:
     void Decrease() {
         if (block_ != nullptr) {
             block_->DecWeak();
-            if (block_->GetCounter() == 0) {
-                delete block_;
-            }
         }
     }
 
     ControlBlock* block_ = nullptr;
     T* ptr_ = nullptr;
 };
+
+// Functors keying ordered and hash containers by owner, for any mix of `SharedPtr`/`WeakPtr`:
+// `std::unordered_map<WeakPtr<T>, V, OwnerHash, OwnerEqual>`
+struct OwnerLess {
+    template <typename Left, typename Right>
+    bool operator()(const Left& left, const Right& right) const {
+        return left.OwnerBefore(right);
+    }
+};
+
+struct OwnerEqual {
+    template <typename Left, typename Right>
+    bool operator()(const Left& left, const Right& right) const {
+        return left.OwnerEqual(right);
+    }
+};
+
+struct OwnerHash {
+    template <typename Ptr>
+    size_t operator()(const Ptr& ptr) const {
+        return ptr.OwnerHash();
+    }
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "shared.h"
+#include "weak.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+
+#ifndef SMART_PTRS_ATOMIC_COUNTERS
+#error "WeakCache is shared between threads and needs SMART_PTRS_ATOMIC_COUNTERS"
+#endif
+
+// Sharded map from keys to weakly held values, for interning and deduplicating expensive
+// objects. Lookups take a shard's lock in shared mode and promote the entry with the lock-free
+// `WeakPtr::Lock()`. Values created by `GetOrCreate` erase their own entry when their last
+// `SharedPtr` is released; other expired entries are dropped when a probe finds them and by
+// periodic sweeps on insertion. `GetOrCreate` runs at most one factory per key at a time, and
+// concurrent callers for that key wait for its result.
+template <typename K, typename V, typename Hash = std::hash<K>, typename Equal = std::equal_to<K>>
+class WeakCache {
+    static constexpr size_t kShards = 16;
+
+    // Construction in progress for one key
+    struct Flight {
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+        SharedPtr<V> value;
+        std::exception_ptr error;
+    };
+
+    struct Entry {
+        WeakPtr<V> value;
+        // Block of `value`, compared when the value unregisters itself
+        const ControlBlock* owner;
+    };
+
+    // Outlives the cache while values created through it are alive
+    struct Shard {
+        std::shared_mutex mutex;
+        std::unordered_map<K, Entry, Hash, Equal> entries;
+        std::unordered_map<K, SharedPtr<Flight>, Hash, Equal> flights;
+        size_t inserts_since_sweep = 0;
+
+        // Drops the entry for `key` if it still refers to `block`
+        void EraseOwnedBy(const K& key, const ControlBlock* block) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            auto it = entries.find(key);
+            if (it != entries.end() && it->second.owner == block) {
+                entries.erase(it);
+            }
+        }
+
+        // Amortized O(1) per insertion: a full sweep every `entries.size()` inserts
+        void Insert(const K& key, const SharedPtr<V>& value, const ControlBlock* owner) {
+            entries.insert_or_assign(key, Entry{WeakPtr<V>(value), owner});
+            if (++inserts_since_sweep < entries.size()) {
+                return;
+            }
+            inserts_since_sweep = 0;
+            for (auto it = entries.begin(); it != entries.end();) {
+                it = it->second.value.Expired() ? entries.erase(it) : std::next(it);
+            }
+        }
+    };
+
+    // `MakeShared` block that unregisters the value when its object is destroyed
+    class CacheBlock : public ControlBlockWithObj<V> {
+    public:
+        CacheBlock(const K& key, SharedPtr<Shard> shard, V&& value)
+            : ControlBlockWithObj<V>(std::move(value)), key_(key), shard_(std::move(shard)) {
+        }
+
+        void DeleteObject() override {
+            shard_->EraseOwnedBy(key_, this);
+            shard_.Reset();
+            ControlBlockWithObj<V>::DeleteObject();
+        }
+
+    private:
+        K key_;
+        SharedPtr<Shard> shard_;
+    };
+
+public:
+    WeakCache() {
+        for (SharedPtr<Shard>& shard : shards_) {
+            shard = MakeShared<Shard>();
+        }
+    }
+
+    WeakCache(const WeakCache&) = delete;
+    WeakCache& operator=(const WeakCache&) = delete;
+
+    // Empty if `key` is absent or its value expired
+    SharedPtr<V> Get(const K& key) {
+        Shard& shard = ShardFor(key);
+        bool expired = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.entries.find(key);
+            if (it == shard.entries.end()) {
+                return SharedPtr<V>();
+            }
+            if (SharedPtr<V> value = it->second.value.Lock()) {
+                return value;
+            }
+            expired = true;
+        }
+        if (expired) {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end() && it->second.value.Expired()) {
+                shard.entries.erase(it);
+            }
+        }
+        return SharedPtr<V>();
+    }
+
+    // Returns the cached value, or stores and returns `factory()` (a `V`). Concurrent callers
+    // for a missing key wait for a single factory call; its exception is rethrown to each.
+    template <typename Factory>
+    SharedPtr<V> GetOrCreate(const K& key, Factory&& factory) {
+        if (SharedPtr<V> value = Get(key)) {
+            return value;
+        }
+
+        Shard& shard = ShardFor(key);
+        SharedPtr<Flight> flight;
+        bool leader = false;
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end()) {
+                if (SharedPtr<V> value = it->second.value.Lock()) {
+                    lock.unlock();
+                    return value;
+                }
+            }
+            auto [flight_it, inserted] = shard.flights.try_emplace(key);
+            if (inserted) {
+                flight_it->second = MakeShared<Flight>();
+            }
+            flight = flight_it->second;
+            leader = inserted;
+        }
+        if (!leader) {
+            return Wait(*flight);
+        }
+
+        SharedPtr<V> value;
+        CacheBlock* block = nullptr;
+        std::exception_ptr error;
+        try {
+            block = new CacheBlock(key, shards_[ShardIndex(key)], factory());
+            value = SharedPtr<V>(static_cast<ControlBlockWithObj<V>*>(block));
+        } catch (...) {
+            error = std::current_exception();
+        }
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            if (value) {
+                // The flight must end even if the entry cannot be stored, or waiters hang
+                try {
+                    shard.Insert(key, value, block);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+            shard.flights.erase(key);
+        }
+        if (error) {
+            // Outside the lock: destroying the value unregisters it from the shard
+            value.Reset();
+        }
+        {
+            std::lock_guard<std::mutex> lock(flight->mutex);
+            flight->done = true;
+            flight->value = value;
+            flight->error = error;
+        }
+        flight->done_cv.notify_all();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return value;
+    }
+
+    // Returns whether an entry, live or expired, was removed
+    bool Erase(const K& key) {
+        Shard& shard = ShardFor(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.entries.erase(key) != 0;
+    }
+
+    // Number of entries, including expired ones not yet dropped
+    size_t Size() const {
+        size_t size = 0;
+        for (const SharedPtr<Shard>& shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            size += shard->entries.size();
+        }
+        return size;
+    }
+
+    // Drops every expired entry
+    void Purge() {
+        for (SharedPtr<Shard>& shard : shards_) {
+            std::unique_lock<std::shared_mutex> lock(shard->mutex);
+            for (auto it = shard->entries.begin(); it != shard->entries.end();) {
+                it = it->second.value.Expired() ? shard->entries.erase(it) : std::next(it);
+            }
+        }
+    }
+
+private:
+    static SharedPtr<V> Wait(Flight& flight) {
+        std::unique_lock<std::mutex> lock(flight.mutex);
+        flight.done_cv.wait(lock, [&flight] { return flight.done; });
+        if (flight.error) {
+            std::rethrow_exception(flight.error);
+        }
+        return flight.value;
+    }
+
+    // High bits: `std::unordered_map` buckets use the low ones
+    static size_t ShardIndex(const K& key) {
+        size_t hash = Hash{}(key);
+        return (hash ^ (hash >> 29) ^ (hash >> 47)) % kShards;
+    }
+
+    Shard& ShardFor(const K& key) {
+        return *shards_[ShardIndex(key)];
+    }
+
+    SharedPtr<Shard> shards_[kShards];
+};